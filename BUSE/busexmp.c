@@ -17,22 +17,997 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "buse.h"
+#include "hash.h"
+#include "lz.h"
 
 /* BUSE callbacks */
 static void *data;
 
+/* How the device content is kept in memory. */
+static enum {
+  MODE_FLAT,      /* one plain buffer, `data` */
+  MODE_COMPRESS,  /* compressed pages, `zpages` */
+  MODE_DEDUP,     /* deduplicated pages, `dmap` */
+  MODE_COW,       /* refcounted chunks shared with snapshots, `cow_root` */
+} mode = MODE_FLAT;
+
+/* The data area is split into regions of (1 << REGION_SHIFT) bytes, each
+ * guarded by its own reader/writer lock, so that requests to different
+ * regions never contend when BUSE serves them from several threads. */
+#define REGION_SHIFT 20
+static pthread_rwlock_t *region_locks;
+static u_int64_t nregions;
+
+/* Lock every region touched by [offset, offset+len), in ascending order so
+ * that overlapping requests cannot deadlock. */
+static void lock_regions(u_int64_t offset, u_int32_t len, int exclusive)
+{
+  u_int64_t r, last = (offset + len - 1) >> REGION_SHIFT;
+
+  for (r = offset >> REGION_SHIFT; r <= last; r++) {
+    if (exclusive)
+      pthread_rwlock_wrlock(&region_locks[r]);
+    else
+      pthread_rwlock_rdlock(&region_locks[r]);
+  }
+}
+
+static void unlock_regions(u_int64_t offset, u_int32_t len)
+{
+  u_int64_t r, last = (offset + len - 1) >> REGION_SHIFT;
+
+  for (r = offset >> REGION_SHIFT; r <= last; r++)
+    pthread_rwlock_unlock(&region_locks[r]);
+}
+
+/* Compressed mode keeps every 4K page in one of three forms: filled with a
+ * repeated 64-bit value (which includes never-written zero pages), LZ
+ * compressed, or raw when compression does not save at least one size
+ * class. Page objects live in a slab arena with a free list per size class. */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1U << PAGE_SHIFT)
+#define ZCLASS_SIZE 64
+#define ZCLASS_COUNT (PAGE_SIZE / ZCLASS_SIZE)
+#define ZSLAB_SIZE (64 * 1024)
+
+struct zpage {
+  u_int32_t len;    /* 0 if same-filled, PAGE_SIZE if stored raw */
+  u_int64_t fill;   /* fill value of a same-filled page */
+  void *obj;        /* arena object holding the page otherwise */
+};
+static struct zpage *zpages;
+
+struct zclass {
+  pthread_mutex_t lock;
+  void *free;       /* free objects, linked through their first word */
+  char *slab;       /* unused tail of the current slab */
+  size_t slab_left;
+};
+static struct zclass zclasses[ZCLASS_COUNT];
+
+static struct {
+  u_int64_t same_pages, compressed_pages, raw_pages;
+  u_int64_t stored_bytes;   /* size of all live arena objects */
+  u_int64_t arena_bytes;    /* memory taken for slabs */
+  u_int64_t compress_calls, compress_ns;
+  u_int64_t decompress_calls, decompress_ns;
+} zstats;
+
+#define ZSTAT_ADD(field, n) __atomic_add_fetch(&zstats.field, (n), __ATOMIC_RELAXED)
+
+static u_int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct zclass *zclass_of(u_int32_t len)
+{
+  return &zclasses[(len + ZCLASS_SIZE - 1) / ZCLASS_SIZE - 1];
+}
+
+static void *zalloc(u_int32_t len)
+{
+  struct zclass *zc = zclass_of(len);
+  size_t size = (zc - zclasses + 1) * ZCLASS_SIZE;
+  void *obj;
+
+  pthread_mutex_lock(&zc->lock);
+  if (zc->free != NULL) {
+    obj = zc->free;
+    zc->free = *(void **)obj;
+  } else {
+    if (zc->slab_left < size) {
+      zc->slab = malloc(ZSLAB_SIZE);
+      if (zc->slab == NULL) err(EXIT_FAILURE, "failed to alloc compressed page slab");
+      zc->slab_left = ZSLAB_SIZE;
+      ZSTAT_ADD(arena_bytes, ZSLAB_SIZE);
+    }
+    obj = zc->slab;
+    zc->slab += size;
+    zc->slab_left -= size;
+  }
+  pthread_mutex_unlock(&zc->lock);
+  ZSTAT_ADD(stored_bytes, size);
+  return obj;
+}
+
+static void zfree(void *obj, u_int32_t len)
+{
+  struct zclass *zc = zclass_of(len);
+
+  pthread_mutex_lock(&zc->lock);
+  *(void **)obj = zc->free;
+  zc->free = obj;
+  pthread_mutex_unlock(&zc->lock);
+  ZSTAT_ADD(stored_bytes, -(u_int64_t)((zc - zclasses + 1) * ZCLASS_SIZE));
+}
+
+/* Drop whatever a page holds, leaving it zero-filled. */
+static void zpage_release(struct zpage *zp)
+{
+  if (zp->len == 0) {
+    ZSTAT_ADD(same_pages, -1);
+  } else {
+    zfree(zp->obj, zp->len);
+    if (zp->len == PAGE_SIZE)
+      ZSTAT_ADD(raw_pages, -1);
+    else
+      ZSTAT_ADD(compressed_pages, -1);
+  }
+  zp->len = 0;
+  zp->fill = 0;
+  zp->obj = NULL;
+  ZSTAT_ADD(same_pages, 1);
+}
+
+static void zpage_load(const struct zpage *zp, void *page)
+{
+  u_int64_t start;
+  u_int32_t i;
+
+  if (zp->len == 0) {
+    for (i = 0; i < PAGE_SIZE; i += sizeof(zp->fill))
+      memcpy((char *)page + i, &zp->fill, sizeof(zp->fill));
+  } else if (zp->len == PAGE_SIZE) {
+    memcpy(page, zp->obj, PAGE_SIZE);
+  } else {
+    start = now_ns();
+    if (lz_decompress(zp->obj, zp->len, page, PAGE_SIZE) != PAGE_SIZE)
+      errx(EXIT_FAILURE, "corrupt compressed page");
+    ZSTAT_ADD(decompress_ns, now_ns() - start);
+    ZSTAT_ADD(decompress_calls, 1);
+  }
+}
+
+static void zpage_store(struct zpage *zp, const void *page)
+{
+  char out[PAGE_SIZE];
+  u_int64_t fill, word, start;
+  u_int32_t i, len;
+
+  memcpy(&fill, page, sizeof(fill));
+  for (i = sizeof(fill); i < PAGE_SIZE; i += sizeof(word)) {
+    memcpy(&word, (const char *)page + i, sizeof(word));
+    if (word != fill)
+      break;
+  }
+  zpage_release(zp);
+  if (i == PAGE_SIZE) {
+    zp->fill = fill;
+    return;
+  }
+  ZSTAT_ADD(same_pages, -1);
+
+  start = now_ns();
+  len = lz_compress(page, PAGE_SIZE, out, PAGE_SIZE - ZCLASS_SIZE);
+  ZSTAT_ADD(compress_ns, now_ns() - start);
+  ZSTAT_ADD(compress_calls, 1);
+  if (len == 0) {
+    zp->len = PAGE_SIZE;
+    zp->obj = zalloc(PAGE_SIZE);
+    memcpy(zp->obj, page, PAGE_SIZE);
+    ZSTAT_ADD(raw_pages, 1);
+  } else {
+    zp->len = len;
+    zp->obj = zalloc(len);
+    memcpy(zp->obj, out, len);
+    ZSTAT_ADD(compressed_pages, 1);
+  }
+}
+
+static void compressed_read(void *buf, u_int32_t len, u_int64_t offset)
+{
+  char page[PAGE_SIZE];
+  struct zpage *zp;
+  u_int32_t in_page, n, i;
+
+  while (len > 0) {
+    zp = &zpages[offset >> PAGE_SHIFT];
+    in_page = offset & (PAGE_SIZE - 1);
+    n = PAGE_SIZE - in_page < len ? PAGE_SIZE - in_page : len;
+    if (n == PAGE_SIZE) {
+      /* Whole pages are decompressed straight into the reply. */
+      zpage_load(zp, buf);
+    } else if (zp->len == 0) {
+      for (i = 0; i < n; i++)
+        ((char *)buf)[i] = ((char *)&zp->fill)[(in_page + i) % sizeof(zp->fill)];
+    } else if (zp->len == PAGE_SIZE) {
+      memcpy(buf, (char *)zp->obj + in_page, n);
+    } else {
+      zpage_load(zp, page);
+      memcpy(buf, page + in_page, n);
+    }
+    buf = (char *)buf + n;
+    offset += n;
+    len -= n;
+  }
+}
+
+static void compressed_write(const void *buf, u_int32_t len, u_int64_t offset)
+{
+  char page[PAGE_SIZE];
+  struct zpage *zp;
+  u_int32_t in_page, n;
+
+  while (len > 0) {
+    zp = &zpages[offset >> PAGE_SHIFT];
+    in_page = offset & (PAGE_SIZE - 1);
+    n = PAGE_SIZE - in_page < len ? PAGE_SIZE - in_page : len;
+    if (n == PAGE_SIZE) {
+      zpage_store(zp, buf);
+    } else {
+      zpage_load(zp, page);
+      memcpy(page + in_page, buf, n);
+      zpage_store(zp, page);
+    }
+    buf = (const char *)buf + n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/* Trimmed pages that are fully covered go back to the arena. */
+static void compressed_trim(u_int64_t from, u_int32_t len)
+{
+  u_int64_t pg = (from + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  u_int64_t end = (from + len) >> PAGE_SHIFT;
+
+  for (; pg < end; pg++)
+    zpage_release(&zpages[pg]);
+}
+
+static void print_compress_stats(void)
+{
+  u_int64_t pages = zstats.same_pages + zstats.compressed_pages + zstats.raw_pages;
+  u_int64_t stored = zstats.stored_bytes;
+
+  fprintf(stderr, "compressed store: %lu pages, %lu same-filled, %lu compressed, %lu raw\n",
+      pages, zstats.same_pages, zstats.compressed_pages, zstats.raw_pages);
+  fprintf(stderr, "  %lu bytes in %lu bytes of objects (ratio %.2f), %lu bytes of slabs\n",
+      pages * PAGE_SIZE, stored, stored ? (double)(pages * PAGE_SIZE) / stored : 0.0,
+      zstats.arena_bytes);
+  fprintf(stderr, "  compress: %lu calls, %.0f ns/call; decompress: %lu calls, %.0f ns/call\n",
+      zstats.compress_calls,
+      zstats.compress_calls ? (double)zstats.compress_ns / zstats.compress_calls : 0.0,
+      zstats.decompress_calls,
+      zstats.decompress_calls ? (double)zstats.decompress_ns / zstats.decompress_calls : 0.0);
+}
+
+/* Dedup mode maps every 4K page to a refcounted block in a content store
+ * indexed by the 128-bit hash of the block, so identical pages are stored
+ * once. Blocks are never modified in place: a write links the page to the
+ * block holding its new content and drops the reference to the old one.
+ * Zero pages map to NULL. */
+struct dblock {
+  struct dblock *next;    /* hash chain */
+  u_int64_t hash[2];
+  u_int32_t refs;
+  char data[];
+};
+static struct dblock **dmap;
+
+/* The content store is a chained hash table whose buckets are guarded by
+ * DLOCK_COUNT striped mutexes; a block's refcount is protected by the lock
+ * of its bucket. */
+#define DLOCK_COUNT 256
+static struct dblock **dbuckets;
+static u_int64_t dbucket_mask;
+static pthread_mutex_t dlocks[DLOCK_COUNT];
+
+static struct {
+  u_int64_t mapped_pages;   /* pages pointing at a block */
+  u_int64_t unique_blocks;  /* blocks in the content store */
+} dstats;
+
+#define DSTAT_ADD(field, n) __atomic_add_fetch(&dstats.field, (n), __ATOMIC_RELAXED)
+
+static pthread_mutex_t *dlock_of(const u_int64_t hash[2])
+{
+  return &dlocks[(hash[0] & dbucket_mask) % DLOCK_COUNT];
+}
+
+/* Return a referenced block holding page, adding it to the store if no
+ * block with the same content exists yet. */
+static struct dblock *dblock_get(const void *page)
+{
+  u_int64_t hash[2];
+  struct dblock **bucket, *db;
+  pthread_mutex_t *lock;
+
+  hash128(page, PAGE_SIZE, 0, hash);
+  bucket = &dbuckets[hash[0] & dbucket_mask];
+  lock = dlock_of(hash);
+
+  pthread_mutex_lock(lock);
+  for (db = *bucket; db != NULL; db = db->next) {
+    if (db->hash[0] == hash[0] && db->hash[1] == hash[1] &&
+        memcmp(db->data, page, PAGE_SIZE) == 0) {
+      db->refs++;
+      pthread_mutex_unlock(lock);
+      return db;
+    }
+  }
+  db = malloc(sizeof(*db) + PAGE_SIZE);
+  if (db == NULL) err(EXIT_FAILURE, "failed to alloc dedup block");
+  db->hash[0] = hash[0];
+  db->hash[1] = hash[1];
+  db->refs = 1;
+  memcpy(db->data, page, PAGE_SIZE);
+  db->next = *bucket;
+  *bucket = db;
+  pthread_mutex_unlock(lock);
+  DSTAT_ADD(unique_blocks, 1);
+  return db;
+}
+
+/* Drop a reference, freeing the block once nothing maps it. */
+static void dblock_put(struct dblock *db)
+{
+  struct dblock **pp;
+  pthread_mutex_t *lock;
+
+  if (db == NULL)
+    return;
+  lock = dlock_of(db->hash);
+  pthread_mutex_lock(lock);
+  if (--db->refs > 0) {
+    pthread_mutex_unlock(lock);
+    return;
+  }
+  for (pp = &dbuckets[db->hash[0] & dbucket_mask]; *pp != db; pp = &(*pp)->next)
+    ;
+  *pp = db->next;
+  pthread_mutex_unlock(lock);
+  free(db);
+  DSTAT_ADD(unique_blocks, -1);
+}
+
+static void dedup_set(u_int64_t pg, const void *page)
+{
+  static const u_int64_t zero[PAGE_SIZE / sizeof(u_int64_t)];
+  struct dblock *old = dmap[pg];
+
+  if (memcmp(page, zero, PAGE_SIZE) == 0) {
+    dmap[pg] = NULL;
+  } else {
+    dmap[pg] = dblock_get(page);
+    if (old == NULL)
+      DSTAT_ADD(mapped_pages, 1);
+  }
+  if (old != NULL && dmap[pg] == NULL)
+    DSTAT_ADD(mapped_pages, -1);
+  dblock_put(old);
+}
+
+static void dedup_read(void *buf, u_int32_t len, u_int64_t offset)
+{
+  struct dblock *db;
+  u_int32_t in_page, n;
+
+  while (len > 0) {
+    db = dmap[offset >> PAGE_SHIFT];
+    in_page = offset & (PAGE_SIZE - 1);
+    n = PAGE_SIZE - in_page < len ? PAGE_SIZE - in_page : len;
+    if (db == NULL)
+      memset(buf, 0, n);
+    else
+      memcpy(buf, db->data + in_page, n);
+    buf = (char *)buf + n;
+    offset += n;
+    len -= n;
+  }
+}
+
+static void dedup_write(const void *buf, u_int32_t len, u_int64_t offset)
+{
+  char page[PAGE_SIZE];
+  u_int64_t pg;
+  u_int32_t in_page, n;
+
+  while (len > 0) {
+    pg = offset >> PAGE_SHIFT;
+    in_page = offset & (PAGE_SIZE - 1);
+    n = PAGE_SIZE - in_page < len ? PAGE_SIZE - in_page : len;
+    if (n == PAGE_SIZE) {
+      dedup_set(pg, buf);
+    } else {
+      dedup_read(page, PAGE_SIZE, pg << PAGE_SHIFT);
+      memcpy(page + in_page, buf, n);
+      dedup_set(pg, page);
+    }
+    buf = (const char *)buf + n;
+    offset += n;
+    len -= n;
+  }
+}
+
+static void dedup_trim(u_int64_t from, u_int32_t len)
+{
+  u_int64_t pg = (from + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  u_int64_t end = (from + len) >> PAGE_SHIFT;
+
+  for (; pg < end; pg++) {
+    if (dmap[pg] != NULL) {
+      dblock_put(dmap[pg]);
+      dmap[pg] = NULL;
+      DSTAT_ADD(mapped_pages, -1);
+    }
+  }
+}
+
+static void print_dedup_stats(void)
+{
+  fprintf(stderr, "dedup store: %lu pages mapped to %lu unique blocks (factor %.2f)\n",
+      dstats.mapped_pages, dstats.unique_blocks,
+      dstats.unique_blocks ? (double)dstats.mapped_pages / dstats.unique_blocks : 0.0);
+}
+
+/* Snapshot mode keeps the content in refcounted chunks reached through a
+ * two-level table: the root has one leaf per lock region, and each leaf
+ * points at the chunks of that region (NULL for chunks never written).
+ * A snapshot gets its own root sharing all leaves, so taking one costs a
+ * copy of the root only. Shared leaves and chunks are copied the first
+ * time the origin writes to them, so only chunks written after the
+ * snapshot take new memory. A snapshot is never written to, so it can be
+ * read without locks. */
+#define CHUNK_SHIFT 16
+#define CHUNK_SIZE (1U << CHUNK_SHIFT)
+#define LEAF_CHUNKS (1U << (REGION_SHIFT - CHUNK_SHIFT))
+
+struct chunk {
+  u_int32_t refs;
+  char data[];
+};
+
+struct leaf {
+  u_int32_t refs;
+  struct chunk *chunks[LEAF_CHUNKS];
+};
+
+static struct leaf **cow_root;   /* the origin, one leaf per region */
+static struct leaf **snap_root;  /* the exported snapshot, or NULL */
+static const char *snap_device;
+static struct buse_operations snap_aop;
+static void *snap_userdata;
+
+static void chunk_put(struct chunk *ch)
+{
+  if (ch != NULL && __atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(ch);
+}
+
+static void leaf_put(struct leaf *lf)
+{
+  if (lf == NULL || __atomic_sub_fetch(&lf->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  for (u_int32_t i = 0; i < LEAF_CHUNKS; i++)
+    chunk_put(lf->chunks[i]);
+  free(lf);
+}
+
+static int is_shared(u_int32_t *refs)
+{
+  return __atomic_load_n(refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Return the origin leaf of region r, copying it if a snapshot shares it.
+ * The caller holds the region lock exclusively. */
+static struct leaf *cow_leaf_for_write(u_int64_t r)
+{
+  struct leaf *lf = cow_root[r], *copy;
+
+  if (lf != NULL && !is_shared(&lf->refs))
+    return lf;
+  copy = calloc(1, sizeof(*copy));
+  if (copy == NULL) err(EXIT_FAILURE, "failed to alloc leaf");
+  copy->refs = 1;
+  if (lf != NULL) {
+    for (u_int32_t i = 0; i < LEAF_CHUNKS; i++) {
+      copy->chunks[i] = lf->chunks[i];
+      if (copy->chunks[i] != NULL)
+        __atomic_add_fetch(&copy->chunks[i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    leaf_put(lf);
+  }
+  cow_root[r] = copy;
+  return copy;
+}
+
+/* Return the origin chunk at index c, private to the origin. */
+static struct chunk *cow_chunk_for_write(u_int64_t c)
+{
+  struct leaf *lf = cow_leaf_for_write(c / LEAF_CHUNKS);
+  struct chunk **slot = &lf->chunks[c % LEAF_CHUNKS], *copy;
+
+  if (*slot != NULL && !is_shared(&(*slot)->refs))
+    return *slot;
+  copy = malloc(sizeof(*copy) + CHUNK_SIZE);
+  if (copy == NULL) err(EXIT_FAILURE, "failed to alloc chunk");
+  copy->refs = 1;
+  if (*slot != NULL)
+    memcpy(copy->data, (*slot)->data, CHUNK_SIZE);
+  else
+    memset(copy->data, 0, CHUNK_SIZE);
+  chunk_put(*slot);
+  *slot = copy;
+  return copy;
+}
+
+static void cow_read(struct leaf **root, void *buf, u_int32_t len, u_int64_t offset)
+{
+  struct leaf *lf;
+  struct chunk *ch;
+  u_int64_t c;
+  u_int32_t in_chunk, n;
+
+  while (len > 0) {
+    c = offset >> CHUNK_SHIFT;
+    lf = root[c / LEAF_CHUNKS];
+    ch = lf != NULL ? lf->chunks[c % LEAF_CHUNKS] : NULL;
+    in_chunk = offset & (CHUNK_SIZE - 1);
+    n = CHUNK_SIZE - in_chunk < len ? CHUNK_SIZE - in_chunk : len;
+    if (ch == NULL)
+      memset(buf, 0, n);
+    else
+      memcpy(buf, ch->data + in_chunk, n);
+    buf = (char *)buf + n;
+    offset += n;
+    len -= n;
+  }
+}
+
+static void cow_write(const void *buf, u_int32_t len, u_int64_t offset)
+{
+  struct chunk *ch;
+  u_int32_t in_chunk, n;
+
+  while (len > 0) {
+    ch = cow_chunk_for_write(offset >> CHUNK_SHIFT);
+    in_chunk = offset & (CHUNK_SIZE - 1);
+    n = CHUNK_SIZE - in_chunk < len ? CHUNK_SIZE - in_chunk : len;
+    memcpy(ch->data + in_chunk, buf, n);
+    buf = (const char *)buf + n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/* Fully trimmed chunks are dropped from the origin. */
+static void cow_trim(u_int64_t from, u_int32_t len)
+{
+  u_int64_t c = (from + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+  u_int64_t end = (from + len) >> CHUNK_SHIFT;
+  struct leaf *lf;
+
+  for (; c < end; c++) {
+    if (cow_root[c / LEAF_CHUNKS] == NULL)
+      continue;
+    lf = cow_leaf_for_write(c / LEAF_CHUNKS);
+    chunk_put(lf->chunks[c % LEAF_CHUNKS]);
+    lf->chunks[c % LEAF_CHUNKS] = NULL;
+  }
+}
+
+static int snap_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+  if (*(int *)userdata)
+    fprintf(stderr, "R snapshot - %lu, %u\n", offset, len);
+  cow_read(snap_root, buf, len, offset);
+  return 0;
+}
+
+/* Serve the snapshot until its device is disconnected, then free it. */
+static void *snapshot_thread(void *arg)
+{
+  struct leaf **root = arg;
+
+  if (buse_main(snap_device, &snap_aop, snap_userdata) != 0)
+    warnx("serving snapshot on %s failed", snap_device);
+  for (u_int64_t r = 0; r < nregions; r++)
+    leaf_put(root[r]);
+  free(root);
+  __atomic_store_n(&snap_root, NULL, __ATOMIC_RELEASE);
+  fprintf(stderr, "snapshot on %s released\n", snap_device);
+  return NULL;
+}
+
+static void take_snapshot(void)
+{
+  struct leaf **root;
+  pthread_t tid;
+
+  if (__atomic_load_n(&snap_root, __ATOMIC_ACQUIRE) != NULL) {
+    warnx("a snapshot is still exported on %s", snap_device);
+    return;
+  }
+  root = malloc(nregions * sizeof(*root));
+  if (root == NULL) {
+    warn("failed to alloc snapshot");
+    return;
+  }
+
+  /* Hold every region so that no write is half-way through the root. */
+  for (u_int64_t r = 0; r < nregions; r++)
+    pthread_rwlock_wrlock(&region_locks[r]);
+  for (u_int64_t r = 0; r < nregions; r++) {
+    root[r] = cow_root[r];
+    if (root[r] != NULL)
+      __atomic_add_fetch(&root[r]->refs, 1, __ATOMIC_RELAXED);
+  }
+  for (u_int64_t r = 0; r < nregions; r++)
+    pthread_rwlock_unlock(&region_locks[r]);
+
+  snap_root = root;
+  if (pthread_create(&tid, NULL, snapshot_thread, root) != 0) {
+    warnx("failed to start snapshot thread");
+    return;
+  }
+  pthread_detach(tid);
+  fprintf(stderr, "snapshot taken, exported on %s\n", snap_device);
+}
+
+/* With --file the flat data area is a shared mapping of a file, so the
+ * content survives restarts. Writes mark the chunks they touch dirty, and
+ * a flush msyncs only the dirty ranges, spread over several threads. */
+#define DIRTY_SHIFT 16
+#define FLUSH_THREADS 4
+static u_int64_t *dirty;   /* one bit per chunk, NULL without --file */
+static u_int64_t data_size;
+
+struct flush_job {
+  u_int64_t (*ranges)[2];  /* offset and length of each dirty range */
+  u_int64_t count;
+  u_int64_t next;          /* next range to be synced */
+  int error;
+};
+
+static void mark_dirty(u_int64_t offset, u_int64_t len)
+{
+  u_int64_t c, last = (offset + len - 1) >> DIRTY_SHIFT;
+
+  for (c = offset >> DIRTY_SHIFT; c <= last; c++)
+    __atomic_fetch_or(&dirty[c / 64], 1ULL << (c % 64), __ATOMIC_RELEASE);
+}
+
+static void *flush_worker(void *arg)
+{
+  struct flush_job *job = arg;
+  u_int64_t i;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+    if (msync((char *)data + job->ranges[i][0], job->ranges[i][1], MS_SYNC) == -1) {
+      warn("msync of %lu bytes at %lu failed", job->ranges[i][1], job->ranges[i][0]);
+      /* keep it dirty, so the next flush tries again instead of passing */
+      mark_dirty(job->ranges[i][0], job->ranges[i][1]);
+      job->error = EIO;
+    }
+  }
+  return NULL;
+}
+
+/* Sync the chunks dirtied since the last flush, merged into ranges. */
+static int flush_dirty(void)
+{
+  struct flush_job job = { NULL, 0, 0, 0 };
+  pthread_t workers[FLUSH_THREADS];
+  u_int64_t nchunks = (data_size + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+  u_int64_t w, word, c, start, end, cap = 0;
+  int nworkers = 0;
+
+  for (w = 0; w < (nchunks + 63) / 64; w++) {
+    word = __atomic_exchange_n(&dirty[w], 0, __ATOMIC_ACQUIRE);
+    for (; word != 0; word &= word - 1) {
+      c = w * 64 + __builtin_ctzll(word);
+      start = c << DIRTY_SHIFT;
+      if (start >= data_size)
+        break;
+      end = start + (1 << DIRTY_SHIFT) < data_size ? start + (1 << DIRTY_SHIFT) : data_size;
+      if (job.count > 0 && job.ranges[job.count - 1][0] + job.ranges[job.count - 1][1] == start) {
+        job.ranges[job.count - 1][1] += end - start;
+        continue;
+      }
+      if (job.count == cap) {
+        cap = cap ? cap * 2 : 64;
+        job.ranges = realloc(job.ranges, cap * sizeof(*job.ranges));
+        if (job.ranges == NULL) err(EXIT_FAILURE, "failed to alloc flush ranges");
+      }
+      job.ranges[job.count][0] = start;
+      job.ranges[job.count][1] = end - start;
+      job.count++;
+    }
+  }
+
+  while (nworkers < FLUSH_THREADS - 1 && (u_int64_t)nworkers + 1 < job.count) {
+    if (pthread_create(&workers[nworkers], NULL, flush_worker, &job) != 0)
+      break;
+    nworkers++;
+  }
+  flush_worker(&job);
+  while (nworkers > 0)
+    pthread_join(workers[--nworkers], NULL);
+  free(job.ranges);
+  return job.error;
+}
+
+/* Open FILE and grow it to size if needed. */
+static int open_file(const char *path, u_int64_t size)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) err(EXIT_FAILURE, "failed to open %s", path);
+  if (fstat(fd, &st) == -1) err(EXIT_FAILURE, "failed to stat %s", path);
+  if ((u_int64_t)st.st_size < size && ftruncate(fd, size) == -1)
+    err(EXIT_FAILURE, "failed to grow %s to %lu bytes", path, size);
+  return fd;
+}
+
+/* Without a file, --handover keeps the data in a memfd, sealed at its size
+ * so that a successor can map it without further checks. */
+static int create_memfd(u_int64_t size)
+{
+  int fd;
+
+  fd = memfd_create("busexmp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1) err(EXIT_FAILURE, "failed to create memfd");
+  if (ftruncate(fd, size) == -1) err(EXIT_FAILURE, "failed to size memfd");
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    err(EXIT_FAILURE, "failed to seal memfd");
+  return fd;
+}
+
+static void *map_shared(int fd, u_int64_t size)
+{
+  struct stat st;
+  void *map;
+
+  if (fstat(fd, &st) == -1) err(EXIT_FAILURE, "failed to stat data fd");
+  if ((u_int64_t)st.st_size < size)
+    errx(EXIT_FAILURE, "data fd holds %ld bytes, less than SIZE", st.st_size);
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) err(EXIT_FAILURE, "failed to map data");
+  return map;
+}
+
+/* NUMA placement of the plain disk. The data is either interleaved page by
+ * page over all nodes, or cut into one contiguous shard per node; serving
+ * threads are pinned to the nodes in turn so that each node gets its share
+ * of the copies. */
+
+#define NUMA_MAX_NODES 64
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+static enum {
+  NUMA_NONE,
+  NUMA_INTERLEAVE,
+  NUMA_SHARD,
+} numa;
+static int numa_nodes[NUMA_MAX_NODES];
+static int numa_count;
+static cpu_set_t numa_cpus[NUMA_MAX_NODES];
+
+/* Parse a sysfs list such as "0-3,8,10-11", calling fn for every entry. */
+static int parse_list(const char *path, void (*fn)(int id, void *arg), void *arg)
+{
+  FILE *f;
+  int first, last, n = 0;
+  char sep;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  while (fscanf(f, "%d", &first) == 1) {
+    last = first;
+    if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+      if (fscanf(f, "%d", &last) != 1)
+        break;
+      if (fscanf(f, "%c", &sep) != 1)
+        sep = '\n';
+    }
+    for (; first <= last; first++, n++)
+      fn(first, arg);
+    if (sep != ',')
+      break;
+  }
+  fclose(f);
+  return n;
+}
+
+static void add_node(int id, void *arg)
+{
+  (void)arg;
+  if (id < NUMA_MAX_NODES && numa_count < NUMA_MAX_NODES)
+    numa_nodes[numa_count++] = id;
+}
+
+static void add_cpu(int id, void *arg)
+{
+  if (id < CPU_SETSIZE)
+    CPU_SET(id, (cpu_set_t *)arg);
+}
+
+static void numa_discover(void)
+{
+  char path[64];
+
+  if (parse_list("/sys/devices/system/node/online", add_node, NULL) <= 0) {
+    warnx("no NUMA topology found, assuming a single node");
+    numa_nodes[0] = 0;
+    numa_count = 1;
+  }
+  for (int i = 0; i < numa_count; i++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_nodes[i]);
+    CPU_ZERO(&numa_cpus[i]);
+    parse_list(path, add_cpu, &numa_cpus[i]);
+  }
+}
+
+/* glibc has no mbind wrapper, and we don't want to depend on libnuma. */
+static void numa_bind(void *addr, u_int64_t len, int policy, const int *nodes, int n)
+{
+  unsigned long mask[NUMA_MAX_NODES / LONG_BITS] = {0};
+
+  for (int i = 0; i < n; i++)
+    mask[nodes[i] / LONG_BITS] |= 1UL << (nodes[i] % LONG_BITS);
+  if (syscall(SYS_mbind, addr, len, policy, mask, NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == -1)
+    warn("failed to bind data to NUMA nodes");
+}
+
+/* Apply the policy before the data is first touched. Shards are cut at
+ * align, the page size backing the data. */
+static void numa_place(void *addr, u_int64_t size, u_int64_t align)
+{
+  u_int64_t shard;
+
+  if (numa == NUMA_INTERLEAVE) {
+    numa_bind(addr, size, MPOL_INTERLEAVE, numa_nodes, numa_count);
+  } else if (numa == NUMA_SHARD) {
+    shard = (size / numa_count + align - 1) & ~(align - 1);
+    for (int i = 0; i < numa_count && (u_int64_t)i * shard < size; i++) {
+      u_int64_t start = i * shard;
+      u_int64_t len = size - start < shard ? size - start : shard;
+      numa_bind((char *)addr + start, len, MPOL_BIND, &numa_nodes[i], 1);
+    }
+  }
+}
+
+static void numa_thread_init(u_int32_t index, void *userdata)
+{
+  int i = index % numa_count;
+
+  (void)userdata;
+  if (CPU_COUNT(&numa_cpus[i]) == 0)
+    return;
+  if (pthread_setaffinity_np(pthread_self(), sizeof(numa_cpus[i]), &numa_cpus[i]) != 0)
+    warnx("failed to pin thread %u to node %d", index, numa_nodes[i]);
+}
+
+/* Anonymous memory for the plain disk, on huge pages of the given size if
+ * asked to. Without enough reserved huge pages we fall back to transparent
+ * huge pages. */
+static void *alloc_data(u_int64_t size, u_int64_t huge)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *map = MAP_FAILED;
+
+  /* Huge pages are reserved up front: we'd rather fail now than SIGBUS
+   * later. The plain mapping is NORESERVE, so that like the malloc'ed disk
+   * it replaces, a mostly unused disk only takes what was written. */
+  if (huge) {
+    size = (size + huge - 1) & ~(huge - 1);
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               flags | MAP_HUGETLB | (__builtin_ctzll(huge) << MAP_HUGE_SHIFT), -1, 0);
+    if (map == MAP_FAILED)
+      warn("failed to map %lluK huge pages, using transparent huge pages",
+           (unsigned long long)huge >> 10);
+  }
+  if (map == MAP_FAILED) {
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) err(EXIT_FAILURE, "failed to alloc space for data");
+    if (huge && madvise(map, size, MADV_HUGEPAGE) == -1)
+      warn("failed to enable transparent huge pages");
+    huge = 0;
+  }
+  numa_place(map, size, huge ? huge : (u_int64_t)sysconf(_SC_PAGESIZE));
+  return map;
+}
+
+static void print_stats(void)
+{
+  switch (mode) {
+    case MODE_COMPRESS:
+      print_compress_stats();
+      break;
+    case MODE_DEDUP:
+      print_dedup_stats();
+      break;
+    default:
+      break;
+  }
+}
+
+/* Dump the store statistics whenever SIGUSR1 arrives, take a snapshot
+ * on SIGUSR2. */
+static void *signal_thread(void *arg)
+{
+  sigset_t *set = arg;
+  int sig;
+
+  for (;;) {
+    if (sigwait(set, &sig) != 0)
+      continue;
+    if (sig == SIGUSR1)
+      print_stats();
+    else if (sig == SIGUSR2 && mode == MODE_COW)
+      take_snapshot();
+  }
+  return NULL;
+}
+
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "R - %lu, %u\n", offset, len);
-  memcpy(buf, (char *)data + offset, len);
+  if (len == 0)
+    return 0;
+  lock_regions(offset, len, 0);
+  switch (mode) {
+    case MODE_COMPRESS:
+      compressed_read(buf, len, offset);
+      break;
+    case MODE_DEDUP:
+      dedup_read(buf, len, offset);
+      break;
+    case MODE_COW:
+      cow_read(cow_root, buf, len, offset);
+      break;
+    default:
+      memcpy(buf, (char *)data + offset, len);
+  }
+  unlock_regions(offset, len);
   return 0;
 }
 
@@ -40,7 +1015,25 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
 {
   if (*(int *)userdata)
     fprintf(stderr, "W - %lu, %u\n", offset, len);
-  memcpy((char *)data + offset, buf, len);
+  if (len == 0)
+    return 0;
+  lock_regions(offset, len, 1);
+  switch (mode) {
+    case MODE_COMPRESS:
+      compressed_write(buf, len, offset);
+      break;
+    case MODE_DEDUP:
+      dedup_write(buf, len, offset);
+      break;
+    case MODE_COW:
+      cow_write(buf, len, offset);
+      break;
+    default:
+      memcpy((char *)data + offset, buf, len);
+      if (dirty != NULL)
+        mark_dirty(offset, len);
+  }
+  unlock_regions(offset, len);
   return 0;
 }
 
@@ -48,12 +1041,17 @@ static void xmp_disc(void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "Received a disconnect request.\n");
+  print_stats();
+  if (dirty != NULL)
+    flush_dirty();
 }
 
 static int xmp_flush(void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "Received a flush request.\n");
+  if (dirty != NULL)
+    return flush_dirty();
   return 0;
 }
 
@@ -61,6 +1059,28 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 {
   if (*(int *)userdata)
     fprintf(stderr, "T - %lu, %u\n", from, len);
+  if (len == 0)
+    return 0;
+  if (mode == MODE_FLAT) {
+    /* Give whole trimmed pages of the file back to the filesystem. */
+    u_int64_t start = (from + PAGE_SIZE - 1) & ~(u_int64_t)(PAGE_SIZE - 1);
+    u_int64_t end = (from + len) & ~(u_int64_t)(PAGE_SIZE - 1);
+    if (dirty != NULL && start < end) {
+      lock_regions(from, len, 1);
+      if (madvise((char *)data + start, end - start, MADV_REMOVE) == -1)
+        warn("failed to punch trimmed range out of the data file");
+      unlock_regions(from, len);
+    }
+    return 0;
+  }
+  lock_regions(from, len, 1);
+  if (mode == MODE_COMPRESS)
+    compressed_trim(from, len);
+  else if (mode == MODE_DEDUP)
+    dedup_trim(from, len);
+  else
+    cow_trim(from, len);
+  unlock_regions(from, len);
   return 0;
 }
 
@@ -68,6 +1088,15 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 
 static struct argp_option options[] = {
   {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+  {"threads", 't', "NUM", 0, "Serve requests with NUM threads", 0},
+  {"compress", 'c', 0, 0, "Keep pages compressed, SIGUSR1 prints statistics", 0},
+  {"dedup", 'd', 0, 0, "Store identical pages once, SIGUSR1 prints statistics", 0},
+  {"snapshot", 's', "DEVICE", 0, "Export a read-only snapshot on DEVICE when SIGUSR2 arrives", 0},
+  {"file", 'f', "FILE", 0, "Keep the data in FILE mapped shared, flushes sync dirty chunks", 0},
+  {"handover", 'H', "SOCKET", 0, "Hand the device and its data over to a process connecting to SOCKET", 0},
+  {"takeover", 'T', "SOCKET", 0, "Take the device and its data over from the process listening on SOCKET", 0},
+  {"numa", 'N', "POLICY", 0, "Spread the data over NUMA nodes, POLICY is interleave or shard", 0},
+  {"hugepages", 'P', "SIZE", 0, "Back the data with huge pages of SIZE, 2M or 1G", 0},
   {0},
 };
 
@@ -75,6 +1104,15 @@ struct arguments {
   unsigned long long size;
   char * device;
   int verbose;
+  unsigned threads;
+  int compress;
+  int dedup;
+  char * snapshot;
+  char * file;
+  char * handover;
+  char * takeover;
+  char * numa;
+  unsigned long long hugepages;
 };
 
 static unsigned long long strtoull_with_prefix(const char * str, char * * end) {
@@ -107,6 +1145,51 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       arguments->verbose = 1;
       break;
 
+    case 'c':
+      arguments->compress = 1;
+      break;
+
+    case 'd':
+      arguments->dedup = 1;
+      break;
+
+    case 's':
+      arguments->snapshot = arg;
+      break;
+
+    case 'f':
+      arguments->file = arg;
+      break;
+
+    case 'H':
+      arguments->handover = arg;
+      break;
+
+    case 'T':
+      arguments->takeover = arg;
+      break;
+
+    case 'N':
+      if (strcmp(arg, "interleave") != 0 && strcmp(arg, "shard") != 0) {
+        errx(EXIT_FAILURE, "POLICY must be interleave or shard");
+      }
+      arguments->numa = arg;
+      break;
+
+    case 'P':
+      arguments->hugepages = strtoull_with_prefix(arg, &endptr);
+      if (*endptr != '\0' || (arguments->hugepages != 2 << 20 && arguments->hugepages != 1 << 30)) {
+        errx(EXIT_FAILURE, "huge page SIZE must be 2M or 1G");
+      }
+      break;
+
+    case 't':
+      arguments->threads = strtoul(arg, &endptr, 10);
+      if (*endptr != '\0' || arguments->threads == 0) {
+        errx(EXIT_FAILURE, "NUM must be a positive integer");
+      }
+      break;
+
     case ARGP_KEY_ARG:
       switch (state->arg_num) {
 
@@ -133,6 +1216,27 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         warnx("not enough arguments");
         argp_usage(state);
       }
+      if (arguments->compress + arguments->dedup + (arguments->snapshot != NULL) +
+          (arguments->file != NULL) > 1) {
+        warnx("--compress, --dedup, --snapshot and --file are mutually exclusive");
+        argp_usage(state);
+      }
+      if ((arguments->handover || arguments->takeover) &&
+          (arguments->compress || arguments->dedup || arguments->snapshot)) {
+        warnx("only plain and --file disks can be handed over");
+        argp_usage(state);
+      }
+      if (arguments->numa &&
+          (arguments->compress || arguments->dedup || arguments->snapshot || arguments->file)) {
+        warnx("--numa only places plain disks");
+        argp_usage(state);
+      }
+      if (arguments->hugepages &&
+          (arguments->compress || arguments->dedup || arguments->snapshot || arguments->file ||
+           arguments->handover || arguments->takeover)) {
+        warnx("--hugepages only backs plain disks kept in this process");
+        argp_usage(state);
+      }
       break;
 
     default:
@@ -153,6 +1257,7 @@ static struct argp argp = {
 int main(int argc, char *argv[]) {
   struct arguments arguments = {
     .verbose = 0,
+    .threads = 1,
   };
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
@@ -163,10 +1268,97 @@ int main(int argc, char *argv[]) {
     .flush = xmp_flush,
     .trim = xmp_trim,
     .size = arguments.size,
+    .threads = arguments.threads,
   };
 
-  data = malloc(aop.size);
-  if (data == NULL) err(EXIT_FAILURE, "failed to alloc space for data");
+  nregions = (aop.size >> REGION_SHIFT) + 1;
+  region_locks = calloc(nregions, sizeof(*region_locks));
+  if (region_locks == NULL) err(EXIT_FAILURE, "failed to alloc region locks");
+  for (u_int64_t r = 0; r < nregions; r++)
+    pthread_rwlock_init(&region_locks[r], NULL);
+
+  if (arguments.numa) {
+    numa = strcmp(arguments.numa, "shard") == 0 ? NUMA_SHARD : NUMA_INTERLEAVE;
+    numa_discover();
+    aop.thread_init = numa_thread_init;
+  }
+
+  u_int64_t npages = (aop.size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  if (arguments.compress) {
+    zpages = calloc(npages, sizeof(*zpages));
+    if (zpages == NULL) err(EXIT_FAILURE, "failed to alloc page table");
+    for (u_int32_t c = 0; c < ZCLASS_COUNT; c++)
+      pthread_mutex_init(&zclasses[c].lock, NULL);
+    zstats.same_pages = npages;
+    mode = MODE_COMPRESS;
+  } else if (arguments.dedup) {
+    dmap = calloc(npages, sizeof(*dmap));
+    for (dbucket_mask = 1; dbucket_mask < npages; dbucket_mask <<= 1)
+      ;
+    dbuckets = calloc(dbucket_mask, sizeof(*dbuckets));
+    if (dmap == NULL || dbuckets == NULL) err(EXIT_FAILURE, "failed to alloc block map");
+    dbucket_mask -= 1;
+    for (int l = 0; l < DLOCK_COUNT; l++)
+      pthread_mutex_init(&dlocks[l], NULL);
+    mode = MODE_DEDUP;
+  } else if (arguments.snapshot) {
+    cow_root = calloc(nregions, sizeof(*cow_root));
+    if (cow_root == NULL) err(EXIT_FAILURE, "failed to alloc chunk table");
+    snap_device = arguments.snapshot;
+    snap_aop = aop;
+    snap_aop.read = snap_read;
+    snap_aop.write = NULL;
+    snap_aop.trim = NULL;
+    snap_aop.flush = NULL;
+    snap_aop.disc = NULL;
+    snap_userdata = &arguments.verbose;
+    mode = MODE_COW;
+  } else {
+    static int data_fd = -1;
+    if (arguments.takeover) {
+      if (buse_takeover(arguments.takeover, &data_fd, 1) != 1)
+        errx(EXIT_FAILURE, "failed to take over from %s", arguments.takeover);
+    } else if (arguments.file) {
+      data_fd = open_file(arguments.file, aop.size);
+    } else if (arguments.handover) {
+      data_fd = create_memfd(aop.size);
+    }
+
+    if (data_fd != -1) {
+      data = map_shared(data_fd, aop.size);
+      numa_place(data, aop.size, sysconf(_SC_PAGESIZE));
+    } else if (numa || arguments.hugepages) {
+      data = alloc_data(aop.size, arguments.hugepages);
+    } else {
+      data = malloc(aop.size);
+      if (data == NULL) err(EXIT_FAILURE, "failed to alloc space for data");
+    }
+    if (arguments.file) {
+      data_size = aop.size;
+      u_int64_t words = ((aop.size >> DIRTY_SHIFT) + 64) / 64;
+      dirty = calloc(words, sizeof(*dirty));
+      if (dirty == NULL) err(EXIT_FAILURE, "failed to alloc dirty bitmap");
+      /* We don't know what our predecessor left unflushed. */
+      if (arguments.takeover)
+        memset(dirty, 0xff, words * sizeof(*dirty));
+    }
+    if (arguments.handover) {
+      aop.handover_path = arguments.handover;
+      aop.handover_fds = &data_fd;
+      aop.handover_nfds = 1;
+    }
+  }
+
+  if (mode != MODE_FLAT) {
+    static sigset_t sigs;
+    pthread_t sig_tid;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    if (pthread_create(&sig_tid, NULL, signal_thread, &sigs) != 0)
+      errx(EXIT_FAILURE, "failed to start signal thread");
+  }
 
   return buse_main(arguments.device, &aop, (void *)&arguments.verbose);
 }
@@ -0,0 +1,93 @@
+/*
+ * hash - content hashing for the BUSE examples
+ *
+ * MurmurHash3 was written by Austin Appleby and placed in the public domain.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "hash.h"
+
+static u_int64_t rotl64(u_int64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static u_int64_t fmix64(u_int64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+void hash128(const void *data, size_t len, u_int64_t seed, u_int64_t out[2])
+{
+  const unsigned char *p = data, *tail;
+  const u_int64_t c1 = 0x87c37b91114253d5ULL;
+  const u_int64_t c2 = 0x4cf5ad432745937fULL;
+  u_int64_t h1 = seed, h2 = seed, k1, k2;
+  size_t i, nblocks = len / 16;
+
+  for (i = 0; i < nblocks; i++) {
+    memcpy(&k1, p + i * 16, sizeof(k1));
+    memcpy(&k2, p + i * 16 + 8, sizeof(k2));
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  tail = p + nblocks * 16;
+  k1 = 0;
+  k2 = 0;
+  switch (len & 15) {
+    case 15: k2 ^= (u_int64_t)tail[14] << 48; /* fall through */
+    case 14: k2 ^= (u_int64_t)tail[13] << 40; /* fall through */
+    case 13: k2 ^= (u_int64_t)tail[12] << 32; /* fall through */
+    case 12: k2 ^= (u_int64_t)tail[11] << 24; /* fall through */
+    case 11: k2 ^= (u_int64_t)tail[10] << 16; /* fall through */
+    case 10: k2 ^= (u_int64_t)tail[9] << 8;   /* fall through */
+    case 9:  k2 ^= (u_int64_t)tail[8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* fall through */
+    case 8:  k1 ^= (u_int64_t)tail[7] << 56;  /* fall through */
+    case 7:  k1 ^= (u_int64_t)tail[6] << 48;  /* fall through */
+    case 6:  k1 ^= (u_int64_t)tail[5] << 40;  /* fall through */
+    case 5:  k1 ^= (u_int64_t)tail[4] << 32;  /* fall through */
+    case 4:  k1 ^= (u_int64_t)tail[3] << 24;  /* fall through */
+    case 3:  k1 ^= (u_int64_t)tail[2] << 16;  /* fall through */
+    case 2:  k1 ^= (u_int64_t)tail[1] << 8;   /* fall through */
+    case 1:  k1 ^= (u_int64_t)tail[0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  out[0] = h1;
+  out[1] = h2;
+}
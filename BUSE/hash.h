@@ -0,0 +1,18 @@
+#ifndef HASH_H_INCLUDED
+#define HASH_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+  // 128-bit MurmurHash3 (x64 variant) of len bytes at data, stored in out
+  void hash128(const void *data, size_t len, u_int64_t seed, u_int64_t out[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HASH_H_INCLUDED */
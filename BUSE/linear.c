@@ -0,0 +1,247 @@
+/*
+ * linear - example concatenation of devices using BUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buse.h"
+
+/* The members back to back, sorted by start. Appending a member grows the
+ * device without moving any data. */
+struct extent {
+    u_int64_t start;
+    u_int64_t size;
+    int fd;
+    const char *path;
+};
+
+static struct extent *extents;
+static int nextents;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: linear [-t threads] <virtual device> <device or file>...\n");
+}
+
+/* The extent holding offset, which must be below the device size. */
+static struct extent *find_extent(u_int64_t offset)
+{
+    int lo = 0, hi = nextents - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (extents[mid].start <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &extents[lo];
+}
+
+static int read_all(const struct extent *ext, void *buf, u_int32_t len, u_int64_t offset)
+{
+    ssize_t bytes_read;
+
+    while (len > 0) {
+        bytes_read = pread(ext->fd, buf, len, offset);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read == -1) {
+            warn("failed to read %u bytes at %lu from %s", len, offset, ext->path);
+            return errno;
+        }
+        if (bytes_read == 0) {
+            memset(buf, 0, len);
+            break;
+        }
+        len -= bytes_read;
+        offset += bytes_read;
+        buf = (char *) buf + bytes_read;
+    }
+    return 0;
+}
+
+static int write_all(const struct extent *ext, const void *buf, u_int32_t len, u_int64_t offset)
+{
+    ssize_t bytes_written;
+
+    while (len > 0) {
+        bytes_written = pwrite(ext->fd, buf, len, offset);
+        if (bytes_written == -1 && errno == EINTR)
+            continue;
+        if (bytes_written == -1) {
+            warn("failed to write %u bytes at %lu to %s", len, offset, ext->path);
+            return errno;
+        }
+        len -= bytes_written;
+        offset += bytes_written;
+        buf = (const char *) buf + bytes_written;
+    }
+    return 0;
+}
+
+/* Requests straddling members are split at the boundaries, each piece goes
+ * to its own member. */
+static int linear_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    struct extent *ext = find_extent(offset);
+    u_int64_t n;
+    int ret;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, offset += n, buf = (char *) buf + n, ext++) {
+        n = ext->start + ext->size - offset;
+        if (n > len)
+            n = len;
+        ret = read_all(ext, buf, n, offset - ext->start);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int linear_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    struct extent *ext = find_extent(offset);
+    u_int64_t n;
+    int ret;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, offset += n, buf = (const char *) buf + n, ext++) {
+        n = ext->start + ext->size - offset;
+        if (n > len)
+            n = len;
+        ret = write_all(ext, buf, n, offset - ext->start);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int linear_trim(u_int64_t from, u_int32_t len, void *userdata)
+{
+    struct extent *ext = find_extent(from);
+    u_int64_t n;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, from += n, ext++) {
+        n = ext->start + ext->size - from;
+        if (n > len)
+            n = len;
+        if (fallocate(ext->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from - ext->start, n) == -1 &&
+            errno != EOPNOTSUPP) {
+            warn("failed to trim %lu bytes at %lu on %s", n, from - ext->start, ext->path);
+            return errno;
+        }
+    }
+    return 0;
+}
+
+static int linear_flush(void *userdata)
+{
+    int ret = 0;
+    (void)(userdata);
+
+    for (int i = 0; i < nextents; i++) {
+        if (fdatasync(extents[i].fd) == -1) {
+            warn("failed to sync %s", extents[i].path);
+            ret = errno;
+        }
+    }
+    return ret;
+}
+
+static struct buse_operations bop = {
+    .read = linear_read,
+    .write = linear_write,
+    .flush = linear_flush,
+    .trim = linear_trim,
+};
+
+int main(int argc, char *argv[])
+{
+    struct stat buf;
+    u_int64_t size = 0;
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't':
+            bop.threads = strtoul(optarg, &end, 10);
+            if (*end != '\0' || bop.threads == 0) {
+                usage();
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
+        return -1;
+    }
+
+    nextents = argc - optind - 1;
+    extents = calloc(nextents, sizeof(*extents));
+    if (extents == NULL)
+        err(EXIT_FAILURE, "failed to alloc extent table");
+    for (int i = 0; i < nextents; i++) {
+        struct extent *ext = &extents[i];
+
+        ext->path = argv[optind + 1 + i];
+        ext->fd = open(ext->path, O_RDWR|O_LARGEFILE);
+        if (ext->fd == -1)
+            err(EXIT_FAILURE, "failed to open %s", ext->path);
+        if (fstat(ext->fd, &buf) == -1)
+            err(EXIT_FAILURE, "failed to stat %s", ext->path);
+        if (S_ISBLK(buf.st_mode)) {
+            if (ioctl(ext->fd, BLKGETSIZE64, &ext->size) == -1)
+                err(EXIT_FAILURE, "failed to get the size of %s", ext->path);
+        } else if (S_ISREG(buf.st_mode)) {
+            ext->size = buf.st_size;
+        } else {
+            errx(EXIT_FAILURE, "%s is neither a block device nor a regular file", ext->path);
+        }
+        /* Keep members whole sectors, so that I/O on them stays aligned. */
+        ext->size &= ~(u_int64_t)511;
+        if (ext->size == 0)
+            errx(EXIT_FAILURE, "%s is empty", ext->path);
+        ext->start = size;
+        size += ext->size;
+        fprintf(stderr, "%s: %lu bytes at %lu.\n", ext->path, ext->size, ext->start);
+    }
+    fprintf(stderr, "The size of this device is %lu bytes.\n", size);
+    bop.size = size;
+
+    return buse_main(argv[optind], &bop, NULL);
+}
@@ -20,87 +20,1049 @@
 #define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
-#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <endian.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "tier.h"
 
+/* Only positional I/O on fd, so that several serving threads can share it. */
 static int fd;
 
+/* With -d fd is opened O_DIRECT, and offsets, lengths and buffers must be
+ * multiples of align. Requests that aren't are bounced through an aligned
+ * buffer, and partial blocks at their edges are read, modified and written
+ * back under edge_locks. */
+#define EDGE_LOCKS 64
+
+static int direct;
+static u_int32_t align = 1;
+static pthread_mutex_t edge_locks[EDGE_LOCKS];
+
 static void usage(void)
 {
-    fprintf(stderr, "Usage: loopback <phyical device> <virtual device>\n");
+    fprintf(stderr, "Usage: loopback [-d] [-t threads] [-q depth [-P]] [-o delta] [-l source [-r rate] [-m map]]\n"
+            "                [-s fast device or file [-W]] <phyical device or file> <virtual device>\n");
 }
 
-static int loopback_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+static int read_all(int file, void *buf, u_int32_t len, u_int64_t offset)
 {
-    int bytes_read;
-    (void)(userdata);
+    ssize_t bytes_read;
 
-    lseek64(fd, offset, SEEK_SET);
     while (len > 0) {
-        bytes_read = read(fd, buf, len);
-        assert(bytes_read > 0);
+        bytes_read = pread(file, buf, len, offset);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read == -1) {
+            warn("failed to read %u bytes at %lu", len, offset);
+            return errno;
+        }
+        if (bytes_read == 0) {
+            /* A regular file may have been truncated under us. */
+            memset(buf, 0, len);
+            break;
+        }
         len -= bytes_read;
+        offset += bytes_read;
         buf = (char *) buf + bytes_read;
     }
 
     return 0;
 }
 
-static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+static int write_all(int file, const void *buf, u_int32_t len, u_int64_t offset)
 {
-    int bytes_written;
-    (void)(userdata);
+    ssize_t bytes_written;
 
-    lseek64(fd, offset, SEEK_SET);
     while (len > 0) {
-        bytes_written = write(fd, buf, len);
-        assert(bytes_written > 0);
+        bytes_written = pwrite(file, buf, len, offset);
+        if (bytes_written == -1 && errno == EINTR)
+            continue;
+        if (bytes_written == -1) {
+            warn("failed to write %u bytes at %lu", len, offset);
+            return errno;
+        }
         len -= bytes_written;
-        buf = (char *) buf + bytes_written;
+        offset += bytes_written;
+        buf = (const char *) buf + bytes_written;
     }
 
     return 0;
 }
 
+static int is_aligned(const void *buf, u_int32_t len, u_int64_t offset)
+{
+    return (((uintptr_t) buf | len | offset) & (align - 1)) == 0;
+}
+
+static void *bounce_buffer(u_int64_t start, u_int64_t end)
+{
+    void *bounce;
+
+    if (posix_memalign(&bounce, align, end - start) != 0)
+        return NULL;
+    return bounce;
+}
+
+static int loopback_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    u_int64_t start = offset & ~(u_int64_t)(align - 1);
+    u_int64_t end = (offset + len + align - 1) & ~(u_int64_t)(align - 1);
+    char *bounce;
+    int ret;
+    (void)(userdata);
+
+    if (!direct || is_aligned(buf, len, offset))
+        return read_all(fd, buf, len, offset);
+
+    bounce = bounce_buffer(start, end);
+    if (bounce == NULL)
+        return ENOMEM;
+    ret = read_all(fd, bounce, end - start, start);
+    if (ret == 0)
+        memcpy(buf, bounce + (offset - start), len);
+    free(bounce);
+    return ret;
+}
+
+static int loopback_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    u_int64_t start = offset & ~(u_int64_t)(align - 1);
+    u_int64_t end = (offset + len + align - 1) & ~(u_int64_t)(align - 1);
+    u_int64_t first = start / align % EDGE_LOCKS;
+    u_int64_t last = (end / align - 1) % EDGE_LOCKS;
+    char *bounce;
+    int ret = 0;
+    (void)(userdata);
+
+    if (!direct || is_aligned(buf, len, offset))
+        return write_all(fd, buf, len, offset);
+
+    bounce = bounce_buffer(start, end);
+    if (bounce == NULL)
+        return ENOMEM;
+    /* Two writes to different bytes of one block must not undo each other. */
+    if (first > last) {
+        u_int64_t tmp = first;
+        first = last;
+        last = tmp;
+    }
+    pthread_mutex_lock(&edge_locks[first]);
+    if (last != first)
+        pthread_mutex_lock(&edge_locks[last]);
+    if (offset != start)
+        ret = read_all(fd, bounce, align, start);
+    if (ret == 0 && offset + len != end && (end - start > align || offset == start))
+        ret = read_all(fd, bounce + (end - start - align), align, end - align);
+    if (ret == 0) {
+        memcpy(bounce + (offset - start), buf, len);
+        ret = write_all(fd, bounce, end - start, start);
+    }
+    if (last != first)
+        pthread_mutex_unlock(&edge_locks[last]);
+    pthread_mutex_unlock(&edge_locks[first]);
+    free(bounce);
+    return ret;
+}
+
+/* With -q reads and writes are submitted to an io_uring and completed by
+ * reap_thread, so that a single serving thread keeps up to depth requests
+ * in flight. With -P a kernel thread polls the submission queue, which
+ * saves the io_uring_enter call per request. We talk to the kernel directly
+ * rather than depend on liburing. */
+static struct {
+    int fd;
+    int sqpoll;
+    unsigned *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t lock;     /* serializes submissions */
+    pthread_cond_t space;
+    unsigned depth;
+    unsigned inflight;
+} ring = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+
+static int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void ring_setup(unsigned depth, int sqpoll)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+    ring.fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring.fd == -1)
+        err(EXIT_FAILURE, "failed to set up io_uring");
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+        sq_size = cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        err(EXIT_FAILURE, "failed to map submission queue");
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            err(EXIT_FAILURE, "failed to map completion queue");
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        err(EXIT_FAILURE, "failed to map submission entries");
+
+    ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sq_flags = (unsigned *) (sq + p.sq_off.flags);
+    ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring.sqpoll = sqpoll;
+    ring.depth = depth;
+}
+
+/* Queue the part of req not done yet, req->priv counts the bytes done.
+ * Called under ring.lock with a free slot: at most depth requests are in
+ * flight, so the submission queue never overflows. */
+static void ring_push(struct buse_request *req)
+{
+    u_int32_t done = (uintptr_t) req->priv;
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) req->buf + done;
+    sqe->len = req->len - done;
+    sqe->off = req->offset + done;
+    sqe->user_data = (uintptr_t) req;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (!ring.sqpoll) {
+        while (ring_enter(1, 0, 0) == -1 && errno == EINTR)
+            ;
+    } else {
+        /* Order the tail store before reading whether the poller sleeps. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            ring_enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+    }
+}
+
+static void ring_complete(struct buse_request *req, int error)
+{
+    buse_complete(req, error);
+    pthread_mutex_lock(&ring.lock);
+    ring.inflight--;
+    pthread_cond_signal(&ring.space);
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static void ring_reap(struct buse_request *req, int res)
+{
+    u_int32_t done = (uintptr_t) req->priv;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        res = 0;
+    } else if (res < 0) {
+        warnx("failed to %s %u bytes at %lu: %s", req->write ? "write" : "read",
+              req->len - done, req->offset + done, strerror(-res));
+        ring_complete(req, -res);
+        return;
+    } else if (res == 0) {
+        if (req->write) {
+            ring_complete(req, EIO);
+            return;
+        }
+        /* A regular file may have been truncated under us. */
+        memset((char *) req->buf + done, 0, req->len - done);
+        res = req->len - done;
+    }
+    done += res;
+    if (done == req->len) {
+        ring_complete(req, 0);
+        return;
+    }
+    req->priv = (void *) (uintptr_t) done;
+    pthread_mutex_lock(&ring.lock);
+    ring_push(req);
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static void *reap_thread(void *arg)
+{
+    struct io_uring_cqe *cqe;
+    struct buse_request *req;
+    unsigned head;
+    int res;
+    (void)(arg);
+
+    for (;;) {
+        head = *ring.cq_head;
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            if (ring_enter(0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+                err(EXIT_FAILURE, "failed to wait for io_uring completions");
+            continue;
+        }
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        req = (struct buse_request *) (uintptr_t) cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+        ring_reap(req, res);
+    }
+    return NULL;
+}
+
+static void loopback_submit(struct buse_request *req, void *userdata)
+{
+    /* The rare unaligned request takes the synchronous bounce path. */
+    if (req->len == 0 || (direct && !is_aligned(req->buf, req->len, req->offset))) {
+        if (req->write)
+            buse_complete(req, loopback_write(req->buf, req->len, req->offset, userdata));
+        else
+            buse_complete(req, loopback_read(req->buf, req->len, req->offset, userdata));
+        return;
+    }
+
+    pthread_mutex_lock(&ring.lock);
+    while (ring.inflight == ring.depth)
+        pthread_cond_wait(&ring.space, &ring.lock);
+    ring.inflight++;
+    ring_push(req);
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static int loopback_flush(void *userdata)
+{
+    (void)(userdata);
+
+    if (fdatasync(fd) == -1) {
+        warn("failed to sync");
+        return errno;
+    }
+    return 0;
+}
+
+/* Works for both: files get a hole, block devices a discard. */
+static int loopback_trim(u_int64_t from, u_int32_t len, void *userdata)
+{
+    (void)(userdata);
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, len) == -1 &&
+        errno != EOPNOTSUPP) {
+        warn("failed to trim %u bytes at %lu", len, from);
+        return errno;
+    }
+    return 0;
+}
+
+/* With -o the device is a copy-on-write overlay of fd, which is only read.
+ * The delta file starts with a header and a map holding the delta offset of
+ * every allocated cluster, or zero for clusters still read from the base.
+ * A cluster is copied into the delta when it is first written, appended at
+ * its end, so the delta only grows with what was written. The map is kept in
+ * memory and written back on flush once the clusters it points to are
+ * synced, so that after a crash it never points at garbage. The on-disk
+ * header and map are little endian. */
+#define OVERLAY_MAGIC "BUSEOVL1"
+#define OVERLAY_VERSION 1
+#define OVERLAY_CLUSTER_BITS 16
+#define OVERLAY_MAP_OFFSET 4096
+#define MAP_PAGE_ENTRIES 512
+
+struct overlay_header {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t cluster_bits;
+    u_int64_t size;
+    u_int64_t map_offset;
+    u_int64_t data_offset;
+};
+
+static int delta_fd = -1;
+static u_int32_t cluster_bits;
+static u_int64_t nclusters;
+static u_int64_t *cluster_map;
+static u_int64_t map_offset;
+static u_int64_t delta_end;       /* where the next cluster is appended */
+static u_int64_t base_size;
+static u_int64_t *map_dirty;      /* one bit per MAP_PAGE_ENTRIES entries */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u_int64_t overlay_open(const char *path, u_int64_t size)
+{
+    struct overlay_header hdr;
+    struct stat st;
+    u_int64_t cluster;
+
+    delta_fd = open(path, O_RDWR|O_CREAT|O_LARGEFILE, 0644);
+    if (delta_fd == -1)
+        err(EXIT_FAILURE, "failed to open %s", path);
+    if (fstat(delta_fd, &st) == -1)
+        err(EXIT_FAILURE, "failed to stat %s", path);
+
+    if (st.st_size == 0) {
+        cluster = 1ULL << OVERLAY_CLUSTER_BITS;
+        nclusters = (size + cluster - 1) >> OVERLAY_CLUSTER_BITS;
+        memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+        hdr.version = htole32(OVERLAY_VERSION);
+        hdr.cluster_bits = htole32(OVERLAY_CLUSTER_BITS);
+        hdr.size = htole64(size);
+        hdr.map_offset = htole64(OVERLAY_MAP_OFFSET);
+        hdr.data_offset = htole64((OVERLAY_MAP_OFFSET + nclusters * 8 + cluster - 1) & ~(cluster - 1));
+        if (write_all(delta_fd, &hdr, sizeof(hdr), 0) != 0 ||
+            ftruncate(delta_fd, le64toh(hdr.data_offset)) == -1)
+            errx(EXIT_FAILURE, "failed to create %s", path);
+    } else if (read_all(delta_fd, &hdr, sizeof(hdr), 0) != 0) {
+        errx(EXIT_FAILURE, "failed to read the header of %s", path);
+    }
+    if (memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) != 0 ||
+        le32toh(hdr.version) != OVERLAY_VERSION)
+        errx(EXIT_FAILURE, "%s is not an overlay", path);
+
+    cluster_bits = le32toh(hdr.cluster_bits);
+    if (cluster_bits < 9 || cluster_bits > 24)
+        errx(EXIT_FAILURE, "%s has a bad cluster size", path);
+    cluster = 1ULL << cluster_bits;
+    size = le64toh(hdr.size);
+    nclusters = (size + cluster - 1) >> cluster_bits;
+    map_offset = le64toh(hdr.map_offset);
+    if (base_size != size)
+        warnx("base is %lu bytes, but the overlay was created for %lu", base_size, size);
+
+    cluster_map = calloc(nclusters + MAP_PAGE_ENTRIES, sizeof(*cluster_map));
+    map_dirty = calloc(nclusters / MAP_PAGE_ENTRIES / 64 + 1, sizeof(*map_dirty));
+    if (cluster_map == NULL || map_dirty == NULL)
+        err(EXIT_FAILURE, "failed to alloc cluster map");
+    if (read_all(delta_fd, cluster_map, nclusters * sizeof(*cluster_map), map_offset) != 0)
+        errx(EXIT_FAILURE, "failed to read the cluster map of %s", path);
+    for (u_int64_t c = 0; c < nclusters; c++)
+        cluster_map[c] = le64toh(cluster_map[c]);
+
+    /* Clusters appended after the last flush are lost, not reused. */
+    delta_end = ((u_int64_t) st.st_size + cluster - 1) & ~(cluster - 1);
+    if (delta_end < le64toh(hdr.data_offset))
+        delta_end = le64toh(hdr.data_offset);
+    for (int i = 0; i < EDGE_LOCKS; i++)
+        pthread_mutex_init(&edge_locks[i], NULL);
+    return size;
+}
+
+static int base_read(void *buf, u_int32_t len, u_int64_t offset)
+{
+    if (offset >= base_size) {
+        memset(buf, 0, len);
+        return 0;
+    }
+    return read_all(fd, buf, len, offset);
+}
+
+static int overlay_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    u_int64_t mask = (1ULL << cluster_bits) - 1;
+    u_int64_t where;
+    u_int32_t n;
+    int ret;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, offset += n, buf = (char *) buf + n) {
+        n = mask + 1 - (offset & mask);
+        if (n > len)
+            n = len;
+        where = __atomic_load_n(&cluster_map[offset >> cluster_bits], __ATOMIC_ACQUIRE);
+        if (where)
+            ret = read_all(delta_fd, buf, n, where + (offset & mask));
+        else
+            ret = base_read(buf, n, offset);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* Copy cluster c into the delta, with n bytes of buf written at offset. */
+static int overlay_alloc(u_int64_t c, const void *buf, u_int32_t n, u_int64_t offset)
+{
+    u_int64_t size = 1ULL << cluster_bits;
+    u_int64_t where;
+    char *copy;
+    int ret = 0;
+
+    copy = malloc(size);
+    if (copy == NULL)
+        return ENOMEM;
+    if (n != size)
+        ret = base_read(copy, size, c << cluster_bits);
+    if (ret == 0) {
+        memcpy(copy + (offset & (size - 1)), buf, n);
+        where = __atomic_fetch_add(&delta_end, size, __ATOMIC_RELAXED);
+        ret = write_all(delta_fd, copy, size, where);
+    }
+    free(copy);
+    if (ret != 0)
+        return ret;
+
+    pthread_mutex_lock(&map_lock);
+    __atomic_store_n(&cluster_map[c], where, __ATOMIC_RELEASE);
+    map_dirty[c / MAP_PAGE_ENTRIES / 64] |= 1ULL << (c / MAP_PAGE_ENTRIES % 64);
+    pthread_mutex_unlock(&map_lock);
+    return 0;
+}
+
+static int overlay_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    u_int64_t mask = (1ULL << cluster_bits) - 1;
+    u_int64_t c, where;
+    u_int32_t n;
+    int ret;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, offset += n, buf = (const char *) buf + n) {
+        n = mask + 1 - (offset & mask);
+        if (n > len)
+            n = len;
+        c = offset >> cluster_bits;
+        where = __atomic_load_n(&cluster_map[c], __ATOMIC_ACQUIRE);
+        if (where == 0) {
+            pthread_mutex_lock(&edge_locks[c % EDGE_LOCKS]);
+            where = __atomic_load_n(&cluster_map[c], __ATOMIC_ACQUIRE);
+            ret = where ? 0 : overlay_alloc(c, buf, n, offset);
+            pthread_mutex_unlock(&edge_locks[c % EDGE_LOCKS]);
+            if (ret != 0)
+                return ret;
+            if (where == 0)
+                continue;
+        }
+        ret = write_all(delta_fd, buf, n, where + (offset & mask));
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int overlay_flush(void *userdata)
+{
+    u_int64_t words = nclusters / MAP_PAGE_ENTRIES / 64 + 1;
+    u_int64_t *pages, *dirty;
+    u_int64_t n = 0, p;
+    int ret = 0;
+    (void)(userdata);
+
+    /* Only map pages changed so far are written, their clusters are
+     * already in the delta and get synced first. */
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&map_lock);
+    for (u_int64_t w = 0; w < words; w++)
+        n += __builtin_popcountll(map_dirty[w]);
+    dirty = malloc(words * sizeof(*dirty));
+    pages = malloc(n * MAP_PAGE_ENTRIES * sizeof(*pages) + 1);
+    if (dirty == NULL || pages == NULL) {
+        pthread_mutex_unlock(&map_lock);
+        pthread_mutex_unlock(&flush_lock);
+        free(dirty);
+        free(pages);
+        return ENOMEM;
+    }
+    memcpy(dirty, map_dirty, words * sizeof(*dirty));
+    memset(map_dirty, 0, words * sizeof(*map_dirty));
+    n = 0;
+    for (p = 0; p * MAP_PAGE_ENTRIES < nclusters; p++)
+        if (dirty[p / 64] & (1ULL << (p % 64)))
+            for (int i = 0; i < MAP_PAGE_ENTRIES; i++)
+                pages[n++] = htole64(cluster_map[p * MAP_PAGE_ENTRIES + i]);
+    pthread_mutex_unlock(&map_lock);
+
+    if (fdatasync(delta_fd) == -1)
+        ret = errno;
+    n = 0;
+    for (p = 0; ret == 0 && p * MAP_PAGE_ENTRIES < nclusters; p++) {
+        if (!(dirty[p / 64] & (1ULL << (p % 64))))
+            continue;
+        u_int64_t count = nclusters - p * MAP_PAGE_ENTRIES;
+        if (count > MAP_PAGE_ENTRIES)
+            count = MAP_PAGE_ENTRIES;
+        ret = write_all(delta_fd, &pages[n], count * sizeof(*pages),
+                        map_offset + p * MAP_PAGE_ENTRIES * sizeof(*pages));
+        n += MAP_PAGE_ENTRIES;
+    }
+    if (ret == 0 && fdatasync(delta_fd) == -1)
+        ret = errno;
+    if (ret != 0) {
+        warnx("failed to flush the overlay: %s", strerror(ret));
+        /* Try again next time. */
+        pthread_mutex_lock(&map_lock);
+        for (u_int64_t w = 0; w < words; w++)
+            map_dirty[w] |= dirty[w];
+        pthread_mutex_unlock(&map_lock);
+    }
+    free(pages);
+    free(dirty);
+    pthread_mutex_unlock(&flush_lock);
+    return ret;
+}
+
+static void overlay_disc(void *userdata)
+{
+    overlay_flush(userdata);
+}
+
+/* With -l the device is a clone of a slow source, populated lazily into the
+ * local image: a chunk is fetched from the source the first time it is
+ * accessed, and a background thread fetches the others at a bounded rate.
+ * The chunks present locally are tracked in a bitmap, written to the map
+ * file on flush once the chunks are synced, so a restarted clone carries
+ * on where it left off. */
+#define CLONE_CHUNK_BITS 16
+#define CLONE_CHUNK_SIZE (1U << CLONE_CHUNK_BITS)
+
+static int source_fd = -1;
+static u_int64_t source_size;
+static u_int64_t nchunks;
+static u_int64_t *present;
+static u_int64_t missing;         /* chunks not fetched yet */
+static int map_fd = -1;
+static int map_changed;
+static u_int64_t prefetch_rate;   /* bytes per second, 0 to only fetch on demand */
+
+static int is_present(u_int64_t c)
+{
+    return (__atomic_load_n(&present[c / 64], __ATOMIC_ACQUIRE) >> (c % 64)) & 1;
+}
+
+static void set_present(u_int64_t c)
+{
+    __atomic_fetch_or(&present[c / 64], 1ULL << (c % 64), __ATOMIC_RELEASE);
+    __atomic_store_n(&map_changed, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&missing, 1, __ATOMIC_RELAXED) == 0)
+        fprintf(stderr, "Clone complete, the source is no longer needed.\n");
+}
+
+static void clone_open(const char *map_path, u_int64_t size)
+{
+    u_int64_t words;
+    struct stat st;
+
+    source_size = size;
+    nchunks = (size + CLONE_CHUNK_SIZE - 1) >> CLONE_CHUNK_BITS;
+    words = (nchunks + 63) / 64;
+    present = calloc(words, sizeof(*present));
+    if (present == NULL)
+        err(EXIT_FAILURE, "failed to alloc chunk bitmap");
+
+    map_fd = open(map_path, O_RDWR|O_CREAT, 0644);
+    if (map_fd == -1)
+        err(EXIT_FAILURE, "failed to open %s", map_path);
+    if (fstat(map_fd, &st) == -1)
+        err(EXIT_FAILURE, "failed to stat %s", map_path);
+    if ((u_int64_t) st.st_size == words * sizeof(*present)) {
+        if (read_all(map_fd, present, words * sizeof(*present), 0) != 0)
+            errx(EXIT_FAILURE, "failed to read %s", map_path);
+        for (u_int64_t w = 0; w < words; w++)
+            present[w] = le64toh(present[w]);
+    } else if (st.st_size != 0) {
+        warnx("%s doesn't match the source, fetching everything again", map_path);
+    }
+    missing = nchunks;
+    for (u_int64_t w = 0; w < words; w++)
+        missing -= __builtin_popcountll(present[w]);
+    fprintf(stderr, "%lu of %lu chunks still to fetch.\n", missing, nchunks);
+    for (int i = 0; i < EDGE_LOCKS; i++)
+        pthread_mutex_init(&edge_locks[i], NULL);
+}
+
+/* Copy chunk c from the source into the local image, with n bytes of buf
+ * written over it at offset if buf is set. */
+static int clone_fetch(u_int64_t c, const void *buf, u_int32_t n, u_int64_t offset)
+{
+    u_int64_t start = c << CLONE_CHUNK_BITS;
+    u_int32_t size = source_size - start < CLONE_CHUNK_SIZE ? source_size - start : CLONE_CHUNK_SIZE;
+    pthread_mutex_t *lock = &edge_locks[c % EDGE_LOCKS];
+    char *chunk;
+    int ret = 0;
+
+    pthread_mutex_lock(lock);
+    if (is_present(c)) {
+        pthread_mutex_unlock(lock);
+        return buf ? write_all(fd, buf, n, offset) : 0;
+    }
+    chunk = malloc(size);
+    if (chunk == NULL) {
+        pthread_mutex_unlock(lock);
+        return ENOMEM;
+    }
+    if (buf == NULL || n != size)
+        ret = read_all(source_fd, chunk, size, start);
+    if (ret == 0) {
+        if (buf)
+            memcpy(chunk + (offset - start), buf, n);
+        ret = write_all(fd, chunk, size, start);
+    }
+    if (ret == 0)
+        set_present(c);
+    pthread_mutex_unlock(lock);
+    free(chunk);
+    return ret;
+}
+
+static int clone_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    u_int32_t n;
+    int ret;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, offset += n, buf = (char *) buf + n) {
+        n = CLONE_CHUNK_SIZE - (offset & (CLONE_CHUNK_SIZE - 1));
+        if (n > len)
+            n = len;
+        ret = is_present(offset >> CLONE_CHUNK_BITS) ? 0 : clone_fetch(offset >> CLONE_CHUNK_BITS, NULL, 0, 0);
+        if (ret == 0)
+            ret = read_all(fd, buf, n, offset);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int clone_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    u_int32_t n;
+    int ret;
+    (void)(userdata);
+
+    for (; len > 0; len -= n, offset += n, buf = (const char *) buf + n) {
+        n = CLONE_CHUNK_SIZE - (offset & (CLONE_CHUNK_SIZE - 1));
+        if (n > len)
+            n = len;
+        if (is_present(offset >> CLONE_CHUNK_BITS))
+            ret = write_all(fd, buf, n, offset);
+        else
+            ret = clone_fetch(offset >> CLONE_CHUNK_BITS, buf, n, offset);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* A trimmed chunk doesn't need to be fetched any more. */
+static int clone_trim(u_int64_t from, u_int32_t len, void *userdata)
+{
+    u_int64_t first = (from + CLONE_CHUNK_SIZE - 1) >> CLONE_CHUNK_BITS;
+    u_int64_t last = (from + len) >> CLONE_CHUNK_BITS;
+
+    if (from + len == source_size)
+        last = nchunks;
+    for (u_int64_t c = first; c < last; c++) {
+        pthread_mutex_lock(&edge_locks[c % EDGE_LOCKS]);
+        if (!is_present(c))
+            set_present(c);
+        pthread_mutex_unlock(&edge_locks[c % EDGE_LOCKS]);
+    }
+    return loopback_trim(from, len, userdata);
+}
+
+static int clone_flush(void *userdata)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    u_int64_t words = (nchunks + 63) / 64;
+    u_int64_t *copy;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+    if (!__atomic_exchange_n(&map_changed, 0, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_unlock(&lock);
+        return loopback_flush(userdata);
+    }
+    /* Chunks set from here on are synced by the next flush. */
+    copy = malloc(words * sizeof(*copy));
+    if (copy == NULL) {
+        __atomic_store_n(&map_changed, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock);
+        return ENOMEM;
+    }
+    for (u_int64_t w = 0; w < words; w++)
+        copy[w] = htole64(__atomic_load_n(&present[w], __ATOMIC_ACQUIRE));
+    ret = loopback_flush(userdata);
+    if (ret == 0)
+        ret = write_all(map_fd, copy, words * sizeof(*copy), 0);
+    if (ret == 0 && fdatasync(map_fd) == -1)
+        ret = errno;
+    if (ret != 0)
+        __atomic_store_n(&map_changed, 1, __ATOMIC_RELAXED);
+    free(copy);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+static void clone_disc(void *userdata)
+{
+    clone_flush(userdata);
+}
+
+/* Fetch the remaining chunks in order, at most prefetch_rate bytes per
+ * second so that the source keeps serving on-demand fetches quickly. */
+static void *prefetch_thread(void *arg)
+{
+    struct timespec start, now;
+    u_int64_t fetched = 0;
+    double ahead;
+    (void)(arg);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (u_int64_t c = 0; c < nchunks; c++) {
+        if (is_present(c))
+            continue;
+        if (clone_fetch(c, NULL, 0, 0) != 0)
+            continue;
+        fetched += CLONE_CHUNK_SIZE;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ahead = (double) fetched / prefetch_rate -
+                (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+        if (ahead > 0)
+            usleep(ahead * 1e6);
+    }
+    return NULL;
+}
+
+/* Block devices report their size through an ioctl, image files
+ * through their length. */
+static u_int64_t device_size(int file, const char *path)
+{
+    struct stat buf;
+    u_int64_t size;
+
+    if (fstat(file, &buf) == -1)
+        err(EXIT_FAILURE, "failed to stat %s", path);
+    if (S_ISBLK(buf.st_mode)) {
+        if (ioctl(file, BLKGETSIZE64, &size) == -1)
+            err(EXIT_FAILURE, "failed to get the size of %s", path);
+    } else if (S_ISREG(buf.st_mode)) {
+        size = buf.st_size;
+    } else {
+        errx(EXIT_FAILURE, "%s is neither a block device nor a regular file", path);
+    }
+    return size;
+}
+
+static unsigned long long strtoull_with_prefix(const char *str, char **end)
+{
+    unsigned long long v = strtoull(str, end, 0);
+
+    switch (**end) {
+    case 'K':
+        v <<= 10;
+        *end += 1;
+        break;
+    case 'M':
+        v <<= 20;
+        *end += 1;
+        break;
+    case 'G':
+        v <<= 30;
+        *end += 1;
+        break;
+    }
+    return v;
+}
+
 static struct buse_operations bop = {
     .read = loopback_read,
-    .write = loopback_write
+    .write = loopback_write,
+    .flush = loopback_flush,
+    .trim = loopback_trim,
 };
 
 int main(int argc, char *argv[])
 {
     struct stat buf;
-    int err;
-    int64_t size;
+    u_int64_t size;
+    unsigned long depth = 0;
+    int sqpoll = 0;
+    pthread_t reaper;
+    char *delta = NULL;
+    char *source = NULL;
+    char *map_path = NULL;
+    pthread_t prefetcher;
+    char *ssd = NULL;
+    int ssd_writeback = 0;
+    struct buse_tier *tier;
+    char *end;
+    int opt;
 
-    if (argc != 3) {
+    prefetch_rate = 16 << 20;
+    while ((opt = getopt(argc, argv, "dt:q:Po:l:r:m:s:W")) != -1) {
+        switch (opt) {
+        case 'd':
+            direct = 1;
+            break;
+        case 't':
+            bop.threads = strtoul(optarg, &end, 10);
+            if (*end != '\0' || bop.threads == 0) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'q':
+            depth = strtoul(optarg, &end, 10);
+            if (*end != '\0' || depth == 0 || depth > 4096) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'P':
+            sqpoll = 1;
+            break;
+        case 'o':
+            delta = optarg;
+            break;
+        case 'l':
+            source = optarg;
+            break;
+        case 'r':
+            prefetch_rate = strtoull_with_prefix(optarg, &end);
+            if (*end != '\0') {
+                usage();
+                return -1;
+            }
+            break;
+        case 'm':
+            map_path = optarg;
+            break;
+        case 's':
+            ssd = optarg;
+            break;
+        case 'W':
+            ssd_writeback = 1;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind != 2 || (sqpoll && depth == 0) || (delta && (direct || depth)) ||
+        (source && (direct || depth || delta)) || (ssd && depth) || (ssd_writeback && !ssd)) {
         usage();
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR|O_LARGEFILE);
-    assert(fd != -1);
+    fd = open(argv[optind], (delta ? O_RDONLY : O_RDWR)|O_LARGEFILE|(direct ? O_DIRECT : 0)|
+              (source ? O_CREAT : 0), 0644);
+    if (fd == -1)
+        err(EXIT_FAILURE, "failed to open %s", argv[optind]);
 
-    /* Let's verify that this file is actually a block device. We could support
-     * regular files, too, but we don't need to right now. */
-    fstat(fd, &buf);
-    assert(S_ISBLK(buf.st_mode));
+    if (fstat(fd, &buf) == -1)
+        err(EXIT_FAILURE, "failed to stat %s", argv[optind]);
+    size = device_size(fd, argv[optind]);
 
-    /* Figure out the size of the underlying block device. */
-    err = ioctl(fd, BLKGETSIZE64, &size);
-    assert(err != -1);
-    (void)err;
-    fprintf(stderr, "The size of this device is %ld bytes.\n", size);
+    /* st_blksize is conservative for files, but always safe. */
+    if (direct) {
+        int sector;
+        if (S_ISBLK(buf.st_mode) && ioctl(fd, BLKSSZGET, &sector) != -1)
+            align = sector;
+        else
+            align = buf.st_blksize;
+        if (size % align != 0) {
+            warnx("ignoring the last %lu bytes, which can't be accessed directly", size % align);
+            size -= size % align;
+        }
+        for (int i = 0; i < EDGE_LOCKS; i++)
+            pthread_mutex_init(&edge_locks[i], NULL);
+    }
+    if (source) {
+        source_fd = open(source, O_RDONLY|O_LARGEFILE);
+        if (source_fd == -1)
+            err(EXIT_FAILURE, "failed to open %s", source);
+        size = device_size(source_fd, source);
+        if (S_ISREG(buf.st_mode) && (u_int64_t) buf.st_size < size && ftruncate(fd, size) == -1)
+            err(EXIT_FAILURE, "failed to grow %s", argv[optind]);
+        if (device_size(fd, argv[optind]) < size)
+            errx(EXIT_FAILURE, "%s is smaller than %s", argv[optind], source);
+        if (map_path == NULL) {
+            if (asprintf(&map_path, "%s.map", argv[optind]) == -1)
+                err(EXIT_FAILURE, "failed to alloc map path");
+        }
+        clone_open(map_path, size);
+        bop.read = clone_read;
+        bop.write = clone_write;
+        bop.flush = clone_flush;
+        bop.trim = clone_trim;
+        bop.disc = clone_disc;
+        if (prefetch_rate && missing &&
+            pthread_create(&prefetcher, NULL, prefetch_thread, NULL) != 0)
+            errx(EXIT_FAILURE, "failed to start prefetch thread");
+    }
+    if (delta) {
+        base_size = size;
+        size = overlay_open(delta, size);
+        bop.read = overlay_read;
+        bop.write = overlay_write;
+        bop.flush = overlay_flush;
+        bop.disc = overlay_disc;
+        bop.trim = NULL;
+    }
+    fprintf(stderr, "The size of this device is %lu bytes.\n", size);
     bop.size = size;
 
-    buse_main(argv[2], &bop, NULL);
+    if (depth) {
+        ring_setup(depth, sqpoll);
+        if (pthread_create(&reaper, NULL, reap_thread, NULL) != 0)
+            errx(EXIT_FAILURE, "failed to start io_uring completion thread");
+        bop.read = NULL;
+        bop.write = NULL;
+        bop.submit = loopback_submit;
+    }
 
-    return 0;
+    if (ssd) {
+        int ret;
+
+        tier = buse_tier_create(&bop, NULL, ssd, ssd_writeback);
+        if (tier == NULL)
+            err(EXIT_FAILURE, "failed to set up %s", ssd);
+        ret = buse_main(argv[optind + 1], buse_tier_operations(tier), tier);
+        if (buse_tier_close(tier) != 0) {
+            warnx("failed to save the state of %s", ssd);
+            ret = EXIT_FAILURE;
+        }
+        buse_tier_print_stats(tier, stderr);
+        return ret;
+    }
+
+    return buse_main(argv[optind + 1], &bop, NULL);
 }
@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+set -e
+
+BLOCKDEV=/dev/nbd0
+SIZE=16M
+# quiet version of dd
+DD="dd status=none"
+
+# verify if blockdev is not currently in use
+set +e
+nbd-client -c "$BLOCKDEV" > /dev/null
+if [ $? -ne 1 ]; then
+	echo "device $BLOCKDEV is not ready to use (already in use or corrupted)"
+	exit 1
+fi
+set -e
+
+# on exit do cleanup actions
+function cleanup () {
+	nbd-client -d "$BLOCKDEV" > /dev/null
+	wait
+	rm -f "$TESTFILE" "$SOCKET" "$STOP"
+}
+trap cleanup EXIT
+
+TESTFILE=$(mktemp)
+SOCKET=$(mktemp -u)
+STOP=$(mktemp -u)
+$DD if=/dev/urandom of="$TESTFILE" bs=1M count=4
+
+# attach BUSE device and fill it with some data
+busexmp -H "$SOCKET" "$SIZE" "$BLOCKDEV" &
+OLDPID=$!
+sleep 1
+$DD if="$TESTFILE" of="$BLOCKDEV" bs=1M count=4 oflag=direct
+
+# keep reading the first copy and rewriting a second one while the device
+# is handed over, so requests are in flight during the takeover
+(
+	while [ ! -e "$STOP" ]; do
+		cmp <($DD if="$BLOCKDEV" bs=64K count=64 iflag=direct) "$TESTFILE"
+	done
+) &
+READER=$!
+(
+	while [ ! -e "$STOP" ]; do
+		$DD if="$TESTFILE" of="$BLOCKDEV" bs=64K seek=128 oflag=direct
+	done
+) &
+WRITER=$!
+sleep 0.2
+
+# start a new instance taking over the device, the old one should exit by itself
+busexmp -T "$SOCKET" -H "$SOCKET" "$SIZE" "$BLOCKDEV" &
+wait $OLDPID
+sleep 0.5
+touch "$STOP"
+
+# no request was lost or failed across the takeover
+wait $READER
+wait $WRITER
+
+# device stays connected and keeps its content
+nbd-client -c "$BLOCKDEV" > /dev/null
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 iflag=direct) "$TESTFILE"
+cmp <($DD if="$BLOCKDEV" bs=1M count=4 skip=8 iflag=direct) "$TESTFILE"
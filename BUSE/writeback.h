@@ -0,0 +1,45 @@
+#ifndef WRITEBACK_H_INCLUDED
+#define WRITEBACK_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "buse.h"
+
+  struct buse_writeback;
+
+  struct buse_writeback_stats {
+    u_int64_t absorbed;     // bytes written into the buffer
+    u_int64_t overwritten;  // dirty bytes replaced or trimmed before reaching the backend
+    u_int64_t destaged;     // bytes written back
+    u_int64_t batches;      // destage passes
+    u_int64_t writes;       // backend writes the batches were merged into
+    u_int64_t throttled;    // writes that waited for the buffer to drain
+    u_int64_t dirty;        // bytes dirty right now
+    u_int64_t extents;      // and the number of extents they are in
+  };
+
+  // buffer up to capacity bytes of writes in memory in front of a backend,
+  // and write them back from a background thread. Reads see the buffered
+  // data, a flush returns once everything written before it reached the
+  // backend and the backend flushed. Use it like buse_cache_create().
+  struct buse_writeback *buse_writeback_create(const struct buse_operations *backend,
+      void *userdata, u_int64_t capacity);
+  const struct buse_operations *buse_writeback_operations(struct buse_writeback *wb);
+
+  // write back everything and stop the background thread; returns the
+  // first write-back error not reported by a flush yet.
+  int buse_writeback_close(struct buse_writeback *wb);
+
+  void buse_writeback_get_stats(struct buse_writeback *wb, struct buse_writeback_stats *stats);
+  void buse_writeback_print_stats(struct buse_writeback *wb, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WRITEBACK_H_INCLUDED */
@@ -7,6 +7,17 @@ extern "C" {
 
 #include <sys/types.h>
 
+  // a read or write passed to an asynchronous backend (see submit); buf is
+  // page aligned and holds the data to write, or receives the data read
+  struct buse_request {
+    int write;
+    void *buf;
+    u_int32_t len;
+    u_int64_t offset;
+    void *priv;  // for the backend's own use
+  };
+
+  // the buffers passed to read and write are page aligned
   struct buse_operations {
     int (*read)(void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     int (*write)(const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
@@ -18,10 +29,42 @@ extern "C" {
     u_int64_t size;
     u_int32_t blksize;
     u_int64_t size_blocks;
+
+    // number of threads serving requests concurrently; 0 or 1 serves them
+    // one at a time, otherwise the callbacks above must be thread-safe
+    u_int32_t threads;
+    // called by every serving thread before its first request, with an
+    // index from 0 to threads-1, e.g. to pin it to a CPU or NUMA node
+    void (*thread_init)(u_int32_t index, void *userdata);
+
+    // asynchronous backends set submit instead of read and write: it starts
+    // the request and returns, and buse_complete() is called once it is done,
+    // from any thread. Requests are read off the socket while earlier ones are
+    // still running, so submit should block when the backend is saturated.
+    void (*submit)(struct buse_request *req, void *userdata);
+
+    // hot upgrade: listen on this unix socket for a successor process, and
+    // once one connects, finish the requests in flight and pass it the nbd
+    // connection along with handover_fds (see buse_takeover)
+    const char *handover_path;
+    const int *handover_fds;
+    int handover_nfds;
   };
 
+#define BUSE_MAX_HANDOVER_FDS 16
+
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
 
+  // finish a request passed to submit, error is 0 or an errno value; req
+  // must not be used afterwards
+  void buse_complete(struct buse_request *req, int error);
+
+  // connect to the handover socket of a running process and take over its
+  // nbd connection, which the next buse_main() call serves in place of
+  // dev_file. The backend fds it passed are stored in fds, at most max_fds;
+  // returns their number, or -1 on failure.
+  int buse_takeover(const char *handover_path, int *fds, int max_fds);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,183 @@
+/*
+ * lz - small LZ77 codec used by the BUSE examples
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The stream is a sequence of LZ4-style sequences. Each one starts with a
+ * token byte whose high nibble is the literal count and low nibble the match
+ * length minus LZ_MIN_MATCH; a nibble of 15 is continued by extra bytes that
+ * are added to it until one is below 255. The literals follow, then a 16-bit
+ * little-endian match offset. The last sequence has literals only.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static u_int32_t load32(const unsigned char *p)
+{
+  u_int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static u_int32_t lz_hash(u_int32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Append the continuation bytes of a length that did not fit in its nibble. */
+static unsigned char *put_length(unsigned char *op, unsigned char *oend, size_t len)
+{
+  while (len >= 255) {
+    if (op >= oend)
+      return NULL;
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op >= oend)
+    return NULL;
+  *op++ = len;
+  return op;
+}
+
+/* Emit one sequence; match_len of 0 means a final literal-only sequence. */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+    const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+  size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+  unsigned char *token;
+
+  if (op >= oend)
+    return NULL;
+  token = op++;
+  *token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+  if (lit_len >= 15 && (op = put_length(op, oend, lit_len - 15)) == NULL)
+    return NULL;
+  if ((size_t)(oend - op) < lit_len)
+    return NULL;
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0)
+    return op;
+
+  if (oend - op < 2)
+    return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (ml >= 15)
+    op = put_length(op, oend, ml - 15);
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t srclen, void *dst, size_t dstcap)
+{
+  const unsigned char *base = src, *ip = src, *anchor = src;
+  const unsigned char *iend = base + srclen, *ref, *m;
+  unsigned char *op = dst, *oend = op + dstcap;
+  u_int16_t table[1 << LZ_HASH_BITS];
+  u_int32_t h;
+
+  assert(srclen <= LZ_MAX_INPUT);
+  memset(table, 0, sizeof(table));
+
+  while (iend - ip >= LZ_MIN_MATCH) {
+    h = lz_hash(load32(ip));
+    ref = base + table[h];
+    table[h] = ip - base;
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || load32(ref) != load32(ip)) {
+      /* Skip ahead faster the longer we go without finding a match, so
+       * incompressible data does not cost a hash probe per byte. */
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    for (m = ip + LZ_MIN_MATCH; m < iend && *m == ref[m - ip]; m++)
+      ;
+    op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+    if (op == NULL)
+      return 0;
+    ip = anchor = m;
+  }
+
+  if (anchor < iend || op == dst) {
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+      return 0;
+  }
+  return op - (unsigned char *)dst;
+}
+
+/* Read the continuation bytes of a length; returns -1 past the input end. */
+static long get_length(const unsigned char **ip, const unsigned char *iend, size_t len)
+{
+  unsigned char b;
+
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+long lz_decompress(const void *src, size_t srclen, void *dst, size_t dstcap)
+{
+  const unsigned char *ip = src, *iend = ip + srclen;
+  unsigned char *op = dst, *oend = op + dstcap, *ref;
+  unsigned char token;
+  long lit_len, match_len;
+  size_t offset;
+
+  while (ip < iend) {
+    token = *ip++;
+
+    lit_len = token >> 4;
+    if (lit_len == 15 && (lit_len = get_length(&ip, iend, lit_len)) < 0)
+      return -1;
+    if (iend - ip < lit_len || oend - op < lit_len)
+      return -1;
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    match_len = token & 15;
+    if (match_len == 15 && (match_len = get_length(&ip, iend, match_len)) < 0)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) || oend - op < match_len)
+      return -1;
+
+    /* Matches may overlap their own output, so copy byte by byte. */
+    for (ref = op - offset; match_len > 0; match_len--)
+      *op++ = *ref++;
+  }
+  return op - (unsigned char *)dst;
+}
@@ -0,0 +1,25 @@
+#ifndef LZ_H_INCLUDED
+#define LZ_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+  /* Maximum input size accepted by lz_compress(). */
+#define LZ_MAX_INPUT (64 * 1024)
+
+  // compress srclen bytes of src into dst; returns the compressed size, or 0
+  // if the result would not fit in dstcap bytes
+  size_t lz_compress(const void *src, size_t srclen, void *dst, size_t dstcap);
+
+  // decompress srclen bytes of src into dst; returns the decompressed size,
+  // or -1 if the input is corrupt or does not fit in dstcap bytes
+  long lz_decompress(const void *src, size_t srclen, void *dst, size_t dstcap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ_H_INCLUDED */
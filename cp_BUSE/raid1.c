@@ -15,6 +15,8 @@
 
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -24,6 +26,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buse.h"
@@ -39,21 +42,90 @@ bool degraded = false; // true if we're missing a device
 int ok_dev = -1; // index of dev_fd that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 
-int last_read_dev = 0; // used to interleave reading between the two devices
+// What the read balancing knows about each mirror. A read continuing where
+// the last request on a mirror ended stays on that mirror, so sequential
+// streams keep their readahead. Other reads go where the expected wait is
+// shortest: the requests outstanding on the mirror, plus the one about to
+// be sent, times its recent latency, and one more if the head has to move.
+#define NEAR_DISTANCE (1 << 20) // bytes the head can skip without a real seek
+#define LATENCY_SHIFT 3         // the latency average follows samples by 1/8
+
+struct mirror {
+    int pending;          // requests outstanding
+    uint64_t last_end;    // where the last request sent to it ends
+    uint64_t latency_ns;  // moving average of read latencies
+    uint64_t reads;
+};
+
+struct mirror mirrors[2];
+pthread_mutex_t balance_lock = PTHREAD_MUTEX_INITIALIZER;
+// writes are done one at a time, so that two overlapping ones can't land on
+// the mirrors in different orders; reads still go in parallel
+pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int pick_mirror(u_int32_t len, u_int64_t offset) {
+    uint64_t cost[2];
+    int dev;
+
+    pthread_mutex_lock(&balance_lock);
+    if (mirrors[0].last_end == offset) {
+        dev = 0;
+    } else if (mirrors[1].last_end == offset) {
+        dev = 1;
+    } else {
+        for (int i = 0; i < 2; i++) {
+            uint64_t distance = offset > mirrors[i].last_end ? offset - mirrors[i].last_end : mirrors[i].last_end - offset;
+            cost[i] = (mirrors[i].pending + 1 + (distance > NEAR_DISTANCE)) * (mirrors[i].latency_ns + 1);
+        }
+        dev = cost[1] < cost[0];
+        // a mirror that keeps being passed over looks a bit faster each
+        // time, so one slow sample can't keep it idle for good
+        mirrors[!dev].latency_ns -= mirrors[!dev].latency_ns >> LATENCY_SHIFT;
+    }
+    // the position moves when the read is sent, so the next read of a
+    // stream follows it even while this one is still in flight
+    mirrors[dev].pending++;
+    mirrors[dev].reads++;
+    mirrors[dev].last_end = offset + len;
+    pthread_mutex_unlock(&balance_lock);
+    return dev;
+}
+
+static void read_done(int dev, uint64_t latency_ns) {
+    struct mirror *m = &mirrors[dev];
+
+    pthread_mutex_lock(&balance_lock);
+    m->pending--;
+    if (m->latency_ns == 0)
+        m->latency_ns = latency_ns;
+    else
+        m->latency_ns += ((int64_t)latency_ns - (int64_t)m->latency_ns) >> LATENCY_SHIFT;
+    pthread_mutex_unlock(&balance_lock);
+}
 
 static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    ssize_t done;
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "R - %lu, %u\n", offset, len);
     
     if (degraded) {
         // read from surviving drive
-        pread(dev_fd[ok_dev], buf, len, offset);
+        done = pread(dev_fd[ok_dev], buf, len, offset);
     } else {
-        // read from one of the two drives (we dont care which)
-        last_read_dev = (last_read_dev+1) % 2; // alternate which device we do the read from
-        pread(dev_fd[last_read_dev], buf, len, offset);
+        int dev = pick_mirror(len, offset);
+        uint64_t start = now_ns();
+        done = pread(dev_fd[dev], buf, len, offset);
+        read_done(dev, now_ns() - start);
     }
+    if (done != (ssize_t)len)
+        return done < 0 ? errno : EIO;
     return 0;
 }
 
@@ -67,9 +139,15 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
         pwrite(dev_fd[ok_dev], buf, len, offset); // write to ok drive only
     } else {
         // write to both drives
+        pthread_mutex_lock(&write_lock);
         for (int i=0; i<2; i++) {
             pwrite(dev_fd[i], buf, len, offset); 
         }
+        pthread_mutex_unlock(&write_lock);
+        // both heads are there now
+        pthread_mutex_lock(&balance_lock);
+        mirrors[0].last_end = mirrors[1].last_end = offset + len;
+        pthread_mutex_unlock(&balance_lock);
     }
     return 0;
 }
@@ -108,6 +186,7 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"threads", 't', "NUM", 0, "Serve up to NUM requests at once, so reads can be balanced by load", 0},
     {0},
 };
 
@@ -116,6 +195,7 @@ struct arguments {
     char* device[2];
     char* raid_device;
     int verbose;
+    uint32_t threads;
 };
 
 /* Parse a single option. */
@@ -129,6 +209,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
+        case 't':
+            arguments->threads = strtoul(arg, &endptr, 10);
+            if (*endptr != '\0' || arguments->threads == 0) {
+                errx(EXIT_FAILURE, "NUM must be a positive integer");
+            }
+            break;
+
         case ARGP_KEY_ARG:
             switch (state->arg_num) {
 
@@ -232,6 +319,7 @@ int main(int argc, char *argv[]) {
 
     verbose = arguments.verbose;
     block_size = arguments.block_size;
+    bop.threads = arguments.threads;
     
     raid_device_size=0; // will be detected from the drives available
     ok_dev=-1;
@@ -287,5 +375,8 @@ int main(int argc, char *argv[]) {
     }
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
     
-    return buse_main(arguments.raid_device, &bop, NULL);
+    int ret = buse_main(arguments.raid_device, &bop, NULL);
+    if (verbose)
+        fprintf(stderr, "Reads: %lu from device 0, %lu from device 1.\n", mirrors[0].reads, mirrors[1].reads);
+    return ret;
 }
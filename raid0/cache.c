@@ -0,0 +1,740 @@
+/*
+ * cache - block read cache for BUSE backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Blocks are spread over shards by a hash of their number, each shard with
+ * its own lock, hash table and share of the capacity. Eviction is 2Q: a
+ * block read once enters the A1in FIFO, and is only promoted to the Am LRU
+ * if it is read again after being evicted from A1in, which the A1out ghost
+ * list of recently evicted block numbers remembers. A sequential scan
+ * therefore only cycles through A1in and leaves the hot set in Am alone.
+ *
+ * The cache is write-through and doesn't allocate on writes. To keep a
+ * read that raced with a write from caching stale data, writes bump a
+ * generation counter of the blocks they touch, and a read only caches what
+ * it fetched if the generation didn't change meanwhile.
+ *
+ * A block being fetched from the backend is claimed in its shard, and
+ * other reads that miss it wait for that fetch instead of issuing their
+ * own. Claims are only held while fetching, never while waiting, so two
+ * reads can't wait for each other.
+ *
+ * With readahead on, reads are matched against a small table of streams
+ * by where the previous reads of each stream ended. Once a stream looks
+ * sequential, a background thread reads ahead of it into the cache in
+ * windows that double up to the maximum and are rounded to whole stripes,
+ * issuing the next window while the stream is still consuming the last.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define CACHE_BLOCK_SHIFT 12
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_GENS 64
+#define CACHE_STREAMS 8
+#define CACHE_RA_SLACK (128 * 1024)  /* reordering tolerated within a stream */
+#define CACHE_RA_TRIGGER 3           /* continuing reads before reading ahead */
+#define CACHE_RA_QUEUE 16
+#define CACHE_RA_RUN 256             /* blocks per backend read */
+
+enum { LIST_A1IN, LIST_A1OUT, LIST_AM, LIST_COUNT };
+
+struct cache_entry {
+  u_int64_t block;
+  struct cache_entry *hnext;
+  struct cache_entry *prev, *next;
+  int list;
+  int prefetched;  /* read ahead and not read since */
+  char *data;      /* NULL on A1out */
+};
+
+/* A block claimed by the read fetching it, on the stack of that read. */
+struct cache_fetch {
+  u_int64_t block;
+  u_int32_t gen;  /* of the block when it was claimed */
+  struct cache_fetch *next;
+};
+
+struct cache_shard {
+  pthread_mutex_t lock;
+  struct cache_fetch *fetching;
+  pthread_cond_t fetched;
+  struct cache_entry **buckets;
+  u_int64_t mask;
+  struct cache_entry lists[LIST_COUNT];  /* list heads, most recent first */
+  u_int64_t counts[LIST_COUNT];
+  u_int64_t capacity;                    /* blocks with data */
+  u_int64_t kin, kout;                   /* A1in and A1out sizes */
+  u_int32_t gens[CACHE_GENS];
+  struct buse_cache_stats stats;
+};
+
+struct cache_stream {
+  u_int64_t next;    /* where the stream is expected to continue */
+  u_int64_t ra_end;  /* end of what was read ahead for it */
+  u_int64_t window;  /* size of the last readahead */
+  u_int64_t used;    /* for replacing the least recently used */
+  int seq;           /* reads that continued it */
+};
+
+struct cache_range {
+  u_int64_t start, end;  /* blocks */
+};
+
+struct buse_cache {
+  struct buse_operations ops;
+  struct buse_operations backend;
+  void *userdata;
+  u_int64_t full_blocks;  /* a partial block at the end isn't cached */
+  int serialize;          /* the backend handles one call at a time */
+  pthread_mutex_t backend_lock;
+  struct cache_shard shards[CACHE_SHARDS];
+
+  pthread_mutex_t ra_lock;
+  pthread_cond_t ra_cond;
+  u_int64_t ra_max, ra_stripe;  /* 0 while readahead is off */
+  u_int64_t ra_tick;
+  struct cache_stream streams[CACHE_STREAMS];
+  struct cache_range queue[CACHE_RA_QUEUE];
+  unsigned int queue_head, queue_len;
+  pthread_t ra_thread;
+};
+
+static struct cache_shard *shard_of(struct buse_cache *cache, u_int64_t block) {
+  return &cache->shards[(block * 0x9e3779b97f4a7c15ULL) >> (64 - CACHE_SHARD_BITS)];
+}
+
+static struct cache_entry **bucket_of(struct cache_shard *sh, u_int64_t block) {
+  return &sh->buckets[(block ^ (block >> 17)) & sh->mask];
+}
+
+static struct cache_entry *lookup(struct cache_shard *sh, u_int64_t block) {
+  struct cache_entry *e;
+
+  for (e = *bucket_of(sh, block); e != NULL; e = e->hnext) {
+    if (e->block == block) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void list_unlink(struct cache_shard *sh, struct cache_entry *e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  sh->counts[e->list]--;
+}
+
+static void list_push(struct cache_shard *sh, int list, struct cache_entry *e) {
+  struct cache_entry *head = &sh->lists[list];
+
+  e->list = list;
+  e->next = head->next;
+  e->prev = head;
+  head->next->prev = e;
+  head->next = e;
+  sh->counts[list]++;
+}
+
+static void entry_free(struct cache_shard *sh, struct cache_entry *e) {
+  struct cache_entry **p;
+
+  for (p = bucket_of(sh, e->block); *p != e; p = &(*p)->hnext)
+    ;
+  *p = e->hnext;
+  list_unlink(sh, e);
+  if (e->data) {
+    sh->stats.cached--;
+  }
+  free(e->data);
+  free(e);
+}
+
+/* Make room for one more block. */
+static void reclaim(struct cache_shard *sh) {
+  struct cache_entry *victim;
+
+  if (sh->counts[LIST_A1IN] + sh->counts[LIST_AM] < sh->capacity) {
+    return;
+  }
+  sh->stats.evictions++;
+  if (sh->counts[LIST_A1IN] > sh->kin || sh->counts[LIST_AM] == 0) {
+    victim = sh->lists[LIST_A1IN].prev;
+    list_unlink(sh, victim);
+    free(victim->data);
+    victim->data = NULL;
+    sh->stats.cached--;
+    list_push(sh, LIST_A1OUT, victim);
+    if (sh->counts[LIST_A1OUT] > sh->kout) {
+      entry_free(sh, sh->lists[LIST_A1OUT].prev);
+    }
+  } else {
+    entry_free(sh, sh->lists[LIST_AM].prev);
+  }
+}
+
+/* Cache the content of block, unless it is cached already. */
+static void insert(struct cache_shard *sh, u_int64_t block, const void *data, int prefetched) {
+  struct cache_entry *e = lookup(sh, block);
+  int ghost = e != NULL;
+  char *copy;
+
+  if (e && e->data) {
+    return;
+  }
+  copy = malloc(BUSE_CACHE_BLOCK_SIZE);
+  if (copy == NULL) {
+    return;
+  }
+  memcpy(copy, data, BUSE_CACHE_BLOCK_SIZE);
+  if (ghost) {
+    /* Read again soon after it was evicted, so it is hot, unless it is
+     * only being read ahead. */
+    list_unlink(sh, e);
+    if (prefetched) {
+      ghost = 0;
+    } else {
+      sh->stats.ghost_hits++;
+    }
+  } else {
+    e = malloc(sizeof(*e));
+    if (e == NULL) {
+      free(copy);
+      return;
+    }
+    e->block = block;
+    e->hnext = *bucket_of(sh, block);
+    *bucket_of(sh, block) = e;
+  }
+  reclaim(sh);
+  e->data = copy;
+  e->prefetched = prefetched;
+  sh->stats.cached++;
+  list_push(sh, ghost ? LIST_AM : LIST_A1IN, e);
+}
+
+/* The part of block that overlaps [offset, offset + len): its offset in
+ * the block, its offset in the request and its length. */
+static u_int32_t overlap(u_int64_t block, u_int64_t offset, u_int32_t len,
+    u_int32_t *in_block, u_int32_t *in_req) {
+  u_int64_t start = block << CACHE_BLOCK_SHIFT;
+  u_int64_t end = start + BUSE_CACHE_BLOCK_SIZE;
+
+  if (start < offset) {
+    start = offset;
+  }
+  if (end > offset + len) {
+    end = offset + len;
+  }
+  *in_block = start & (BUSE_CACHE_BLOCK_SIZE - 1);
+  *in_req = start - offset;
+  return end - start;
+}
+
+/* Copy the cached part of block into buf, returns 0 on a miss. waited is
+ * set if the read waited for another one to fetch the block. */
+static int lookup_read(struct buse_cache *cache, u_int64_t block, void *buf, u_int64_t offset,
+    u_int32_t len, int waited) {
+  struct cache_shard *sh = shard_of(cache, block);
+  struct cache_entry *e;
+  u_int32_t in_block, in_req, n;
+
+  pthread_mutex_lock(&sh->lock);
+  e = lookup(sh, block);
+  if (e == NULL || e->data == NULL) {
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
+  }
+  if (e->list == LIST_AM) {
+    list_unlink(sh, e);
+    list_push(sh, LIST_AM, e);
+  }
+  n = overlap(block, offset, len, &in_block, &in_req);
+  memcpy((char *)buf + in_req, e->data + in_block, n);
+  if (waited) {
+    sh->stats.coalesced++;
+  } else {
+    sh->stats.hits++;
+  }
+  if (e->prefetched) {
+    e->prefetched = 0;
+    sh->stats.readahead_hits++;
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return 1;
+}
+
+static struct cache_fetch **find_fetch(struct cache_shard *sh, u_int64_t block) {
+  struct cache_fetch **p;
+
+  for (p = &sh->fetching; *p != NULL && (*p)->block != block; p = &(*p)->next)
+    ;
+  return p;
+}
+
+enum { CLAIM_OK, CLAIM_CACHED, CLAIM_BUSY };
+
+/* Claim block for fetching it into f, unless it is cached or another
+ * read is fetching it already. */
+static int claim(struct buse_cache *cache, u_int64_t block, struct cache_fetch *f) {
+  struct cache_shard *sh = shard_of(cache, block);
+  struct cache_entry *e;
+  int ret = CLAIM_OK;
+
+  pthread_mutex_lock(&sh->lock);
+  e = lookup(sh, block);
+  if (e != NULL && e->data != NULL) {
+    ret = CLAIM_CACHED;
+  } else if (*find_fetch(sh, block) != NULL) {
+    ret = CLAIM_BUSY;
+  } else {
+    f->block = block;
+    f->gen = sh->gens[block % CACHE_GENS];
+    f->next = sh->fetching;
+    sh->fetching = f;
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return ret;
+}
+
+/* Cache what was fetched for a claim if data isn't NULL and the block
+ * wasn't written meanwhile, and wake up the reads waiting for it. */
+static void complete(struct buse_cache *cache, struct cache_fetch *f, const void *data,
+    int prefetched) {
+  struct cache_shard *sh = shard_of(cache, f->block);
+
+  pthread_mutex_lock(&sh->lock);
+  *find_fetch(sh, f->block) = f->next;
+  if (data != NULL) {
+    if (prefetched) {
+      sh->stats.readahead++;
+    } else {
+      sh->stats.misses++;
+    }
+    if (sh->gens[f->block % CACHE_GENS] == f->gen) {
+      insert(sh, f->block, data, prefetched);
+    }
+  }
+  pthread_cond_broadcast(&sh->fetched);
+  pthread_mutex_unlock(&sh->lock);
+}
+
+static void wait_fetched(struct buse_cache *cache, u_int64_t block) {
+  struct cache_shard *sh = shard_of(cache, block);
+
+  pthread_mutex_lock(&sh->lock);
+  while (*find_fetch(sh, block) != NULL) {
+    pthread_cond_wait(&sh->fetched, &sh->lock);
+  }
+  pthread_mutex_unlock(&sh->lock);
+}
+
+static int backend_read(struct buse_cache *cache, void *buf, u_int32_t len, u_int64_t offset) {
+  int ret;
+
+  if (cache->serialize) {
+    pthread_mutex_lock(&cache->backend_lock);
+  }
+  ret = cache->backend.read(buf, len, offset, cache->userdata);
+  if (cache->serialize) {
+    pthread_mutex_unlock(&cache->backend_lock);
+  }
+  return ret;
+}
+
+/* Read the blocks in [block, end) that aren't cached into the cache. */
+static void prefetch(struct buse_cache *cache, u_int64_t block, u_int64_t end) {
+  struct cache_fetch claims[CACHE_RA_RUN];
+  u_int64_t stop;
+  char *run;
+  int ret;
+
+  for (; block < end; block = stop) {
+    if (claim(cache, block, &claims[0]) != CLAIM_OK) {
+      stop = block + 1;
+      continue;
+    }
+    for (stop = block + 1; stop < end && stop - block < CACHE_RA_RUN; stop++) {
+      if (claim(cache, stop, &claims[stop - block]) != CLAIM_OK) {
+        break;
+      }
+    }
+    run = malloc((stop - block) << CACHE_BLOCK_SHIFT);
+    ret = run == NULL ? ENOMEM : backend_read(cache, run, (stop - block) << CACHE_BLOCK_SHIFT,
+        block << CACHE_BLOCK_SHIFT);
+    for (u_int64_t b = block; b < stop; b++) {
+      complete(cache, &claims[b - block], ret == 0 ? run + ((b - block) << CACHE_BLOCK_SHIFT) : NULL, 1);
+    }
+    free(run);
+    if (ret != 0) {
+      return;
+    }
+  }
+}
+
+static void *readahead_thread(void *arg) {
+  struct buse_cache *cache = arg;
+  struct cache_range r;
+
+  pthread_mutex_lock(&cache->ra_lock);
+  for (;;) {
+    while (cache->queue_len == 0) {
+      pthread_cond_wait(&cache->ra_cond, &cache->ra_lock);
+    }
+    r = cache->queue[cache->queue_head];
+    cache->queue_head = (cache->queue_head + 1) % CACHE_RA_QUEUE;
+    cache->queue_len--;
+    pthread_mutex_unlock(&cache->ra_lock);
+    prefetch(cache, r.start, r.end);
+    pthread_mutex_lock(&cache->ra_lock);
+  }
+  return NULL;
+}
+
+/* Match a read against the streams, and read ahead of it if it continues
+ * a sequential one. */
+static void detect(struct buse_cache *cache, u_int64_t offset, u_int32_t len) {
+  struct cache_stream *s, *lru = NULL;
+  u_int64_t end = offset + len, limit = cache->full_blocks << CACHE_BLOCK_SHIFT;
+  u_int64_t from, to;
+
+  pthread_mutex_lock(&cache->ra_lock);
+  if (cache->ra_max == 0) {
+    pthread_mutex_unlock(&cache->ra_lock);
+    return;
+  }
+  cache->ra_tick++;
+  for (s = cache->streams; s < cache->streams + CACHE_STREAMS; s++) {
+    if (s->used != 0 && end > s->next && offset + CACHE_RA_SLACK >= s->next &&
+        offset <= s->next + CACHE_RA_SLACK) {
+      break;
+    }
+    if (lru == NULL || s->used < lru->used) {
+      lru = s;
+    }
+  }
+  if (s == cache->streams + CACHE_STREAMS) {
+    memset(lru, 0, sizeof(*lru));
+    lru->next = lru->ra_end = end;
+    lru->used = cache->ra_tick;
+    pthread_mutex_unlock(&cache->ra_lock);
+    return;
+  }
+  s->used = cache->ra_tick;
+  s->next = end;
+  /* Keep between one and two windows ahead of the stream. */
+  if (++s->seq < CACHE_RA_TRIGGER || (s->window && s->ra_end >= s->next + s->window) ||
+      cache->queue_len == CACHE_RA_QUEUE) {
+    pthread_mutex_unlock(&cache->ra_lock);
+    return;
+  }
+  s->window = s->window ? s->window * 2 : (u_int64_t)len * 4;
+  if (s->window > cache->ra_max) {
+    s->window = cache->ra_max;
+  }
+  from = s->ra_end > s->next ? s->ra_end : s->next;
+  from -= from % cache->ra_stripe;
+  to = from + s->window + cache->ra_stripe - 1;
+  to -= to % cache->ra_stripe;
+  if (to > limit) {
+    to = limit;
+  }
+  if (from < to) {
+    struct cache_range *r = &cache->queue[(cache->queue_head + cache->queue_len) % CACHE_RA_QUEUE];
+    r->start = from >> CACHE_BLOCK_SHIFT;
+    r->end = (to + BUSE_CACHE_BLOCK_SIZE - 1) >> CACHE_BLOCK_SHIFT;
+    cache->queue_len++;
+    s->ra_end = to;
+    pthread_cond_signal(&cache->ra_cond);
+  }
+  pthread_mutex_unlock(&cache->ra_lock);
+}
+
+static int cache_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+  struct buse_cache *cache = userdata;
+  u_int64_t block, end, last;
+  struct cache_fetch claims[64];
+  u_int32_t in_block, in_req, n;
+  u_int64_t start, stop;
+  int waited = 0;
+  char *run;
+  int ret;
+
+  if (len == 0) {
+    return 0;
+  }
+  detect(cache, offset, len);
+  last = (offset + len - 1) >> CACHE_BLOCK_SHIFT;
+  for (block = offset >> CACHE_BLOCK_SHIFT; block <= last; block = end) {
+    end = block;
+    if (block < cache->full_blocks) {
+      if (lookup_read(cache, block, buf, offset, len, waited)) {
+        end = block + 1;
+        waited = 0;
+        continue;
+      }
+      switch (claim(cache, block, &claims[0])) {
+        case CLAIM_CACHED:
+          continue;
+        case CLAIM_BUSY:
+          /* Another read is fetching it, take it from the cache then. */
+          wait_fetched(cache, block);
+          waited = 1;
+          continue;
+      }
+    }
+    waited = 0;
+    /* Fetch the run of missing blocks that starts here in one go. */
+    for (end = block + 1; end <= last && end < cache->full_blocks && end - block < 64; end++) {
+      if (claim(cache, end, &claims[end - block]) != CLAIM_OK) {
+        break;
+      }
+    }
+    start = block << CACHE_BLOCK_SHIFT;
+    stop = end << CACHE_BLOCK_SHIFT;
+    if (end > cache->full_blocks) {
+      stop = cache->ops.size;
+    }
+    run = malloc(stop - start);
+    ret = run == NULL ? ENOMEM : backend_read(cache, run, stop - start, start);
+    for (u_int64_t b = block; b < end; b++) {
+      if (ret == 0) {
+        n = overlap(b, offset, len, &in_block, &in_req);
+        memcpy((char *)buf + in_req, run + ((b - block) << CACHE_BLOCK_SHIFT) + in_block, n);
+      }
+      if (b < cache->full_blocks) {
+        complete(cache, &claims[b - block], ret == 0 ? run + ((b - block) << CACHE_BLOCK_SHIFT) : NULL, 0);
+      }
+    }
+    free(run);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/* After a write or trim reached the backend: bring the cached copies of
+ * the blocks up to date, or drop them if data is NULL. */
+static void update(struct buse_cache *cache, const void *data, u_int32_t len, u_int64_t offset) {
+  u_int64_t last = (offset + len - 1) >> CACHE_BLOCK_SHIFT;
+  u_int32_t in_block, in_req, n;
+  struct cache_entry *e;
+
+  for (u_int64_t block = offset >> CACHE_BLOCK_SHIFT; block <= last; block++) {
+    struct cache_shard *sh = shard_of(cache, block);
+    pthread_mutex_lock(&sh->lock);
+    sh->gens[block % CACHE_GENS]++;
+    e = lookup(sh, block);
+    if (e && e->data) {
+      if (data) {
+        n = overlap(block, offset, len, &in_block, &in_req);
+        memcpy(e->data + in_block, (const char *)data + in_req, n);
+      } else {
+        entry_free(sh, e);
+      }
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+static int cache_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+  struct buse_cache *cache = userdata;
+  int ret;
+
+  if (cache->serialize) {
+    pthread_mutex_lock(&cache->backend_lock);
+  }
+  ret = cache->backend.write(buf, len, offset, cache->userdata);
+  if (cache->serialize) {
+    pthread_mutex_unlock(&cache->backend_lock);
+  }
+  if (len > 0) {
+    update(cache, ret == 0 ? buf : NULL, len, offset);
+  }
+  return ret;
+}
+
+static int cache_trim(u_int64_t from, u_int32_t len, void *userdata) {
+  struct buse_cache *cache = userdata;
+  int ret;
+
+  if (cache->serialize) {
+    pthread_mutex_lock(&cache->backend_lock);
+  }
+  ret = cache->backend.trim(from, len, cache->userdata);
+  if (cache->serialize) {
+    pthread_mutex_unlock(&cache->backend_lock);
+  }
+  if (len > 0) {
+    update(cache, NULL, len, from);
+  }
+  return ret;
+}
+
+static int cache_flush(void *userdata) {
+  struct buse_cache *cache = userdata;
+  int ret;
+
+  if (cache->serialize) {
+    pthread_mutex_lock(&cache->backend_lock);
+  }
+  ret = cache->backend.flush(cache->userdata);
+  if (cache->serialize) {
+    pthread_mutex_unlock(&cache->backend_lock);
+  }
+  return ret;
+}
+
+static void cache_disc(void *userdata) {
+  struct buse_cache *cache = userdata;
+
+  cache->backend.disc(cache->userdata);
+}
+
+static void cache_thread_init(u_int32_t index, void *userdata) {
+  struct buse_cache *cache = userdata;
+
+  cache->backend.thread_init(index, cache->userdata);
+}
+
+struct buse_cache *buse_cache_create(const struct buse_operations *backend, void *userdata,
+    u_int64_t capacity) {
+  struct buse_cache *cache;
+  u_int64_t blocks = capacity >> CACHE_BLOCK_SHIFT;
+  u_int64_t size;
+
+  /* The cache only wraps the synchronous interface. */
+  assert(backend->read != NULL && backend->submit == NULL);
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->backend = *backend;
+  cache->userdata = userdata;
+  cache->ops = *backend;
+  cache->ops.read = cache_read;
+  cache->ops.write = backend->write ? cache_write : NULL;
+  cache->ops.trim = backend->trim ? cache_trim : NULL;
+  cache->ops.flush = backend->flush ? cache_flush : NULL;
+  cache->ops.disc = backend->disc ? cache_disc : NULL;
+  cache->ops.thread_init = backend->thread_init ? cache_thread_init : NULL;
+  size = backend->size ? backend->size : (u_int64_t)backend->blksize * backend->size_blocks;
+  cache->ops.size = size;
+  cache->ops.blksize = 0;
+  cache->ops.size_blocks = 0;
+  cache->full_blocks = size >> CACHE_BLOCK_SHIFT;
+  cache->serialize = backend->threads <= 1;
+  pthread_mutex_init(&cache->backend_lock, NULL);
+  pthread_mutex_init(&cache->ra_lock, NULL);
+  pthread_cond_init(&cache->ra_cond, NULL);
+
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *sh = &cache->shards[i];
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->fetched, NULL);
+    sh->capacity = blocks / CACHE_SHARDS > 0 ? blocks / CACHE_SHARDS : 1;
+    sh->kin = sh->capacity / 4 > 0 ? sh->capacity / 4 : 1;
+    sh->kout = sh->capacity / 2 > 0 ? sh->capacity / 2 : 1;
+    for (sh->mask = 16; sh->mask < sh->capacity + sh->kout; sh->mask <<= 1)
+      ;
+    sh->buckets = calloc(sh->mask, sizeof(*sh->buckets));
+    if (sh->buckets == NULL) {
+      return NULL;
+    }
+    sh->mask -= 1;
+    for (int l = 0; l < LIST_COUNT; l++) {
+      sh->lists[l].next = sh->lists[l].prev = &sh->lists[l];
+    }
+  }
+  return cache;
+}
+
+const struct buse_operations *buse_cache_operations(struct buse_cache *cache) {
+  return &cache->ops;
+}
+
+int buse_cache_set_readahead(struct buse_cache *cache, u_int64_t max, u_int64_t stripe) {
+  int start;
+
+  if (stripe == 0) {
+    stripe = BUSE_CACHE_BLOCK_SIZE;
+  }
+  if (max != 0 && max < stripe) {
+    max = stripe;
+  }
+  pthread_mutex_lock(&cache->ra_lock);
+  start = max != 0 && cache->ra_stripe == 0;
+  if (start && pthread_create(&cache->ra_thread, NULL, readahead_thread, cache) != 0) {
+    pthread_mutex_unlock(&cache->ra_lock);
+    return EAGAIN;
+  }
+  if (start) {
+    pthread_detach(cache->ra_thread);
+  }
+  cache->ra_max = max;
+  if (max != 0) {
+    cache->ra_stripe = stripe;
+  }
+  memset(cache->streams, 0, sizeof(cache->streams));
+  pthread_mutex_unlock(&cache->ra_lock);
+  return 0;
+}
+
+void buse_cache_get_stats(struct buse_cache *cache, struct buse_cache_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *sh = &cache->shards[i];
+    pthread_mutex_lock(&sh->lock);
+    stats->hits += sh->stats.hits;
+    stats->misses += sh->stats.misses;
+    stats->ghost_hits += sh->stats.ghost_hits;
+    stats->evictions += sh->stats.evictions;
+    stats->cached += sh->stats.cached;
+    stats->coalesced += sh->stats.coalesced;
+    stats->readahead += sh->stats.readahead;
+    stats->readahead_hits += sh->stats.readahead_hits;
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+void buse_cache_print_stats(struct buse_cache *cache, FILE *out) {
+  struct buse_cache_stats st;
+  u_int64_t reads;
+
+  buse_cache_get_stats(cache, &st);
+  reads = st.hits + st.misses;
+  fprintf(out, "cache: %lu blocks held (%lu bytes), %lu hits, %lu misses (%.1f%% hit rate), "
+          "%lu promoted on ghost hits, %lu evictions\n",
+          st.cached, st.cached * BUSE_CACHE_BLOCK_SIZE, st.hits, st.misses,
+          reads ? 100.0 * st.hits / reads : 0.0, st.ghost_hits, st.evictions);
+  if (st.coalesced) {
+    fprintf(out, "cache: %lu blocks taken from the fetch of a concurrent read\n", st.coalesced);
+  }
+  if (st.readahead) {
+    fprintf(out, "cache: %lu blocks read ahead, %lu of them read since\n",
+            st.readahead, st.readahead_hits);
+  }
+}
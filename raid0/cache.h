@@ -0,0 +1,49 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "buse.h"
+
+  /* Granularity of the cache. */
+#define BUSE_CACHE_BLOCK_SIZE 4096
+
+  struct buse_cache;
+
+  struct buse_cache_stats {
+    u_int64_t hits;        // blocks read from the cache
+    u_int64_t misses;      // blocks read from the backend
+    u_int64_t coalesced;   // misses that waited for a concurrent read to fetch the block
+    u_int64_t ghost_hits;  // misses on recently evicted blocks, cached as hot
+    u_int64_t evictions;
+    u_int64_t cached;      // blocks held right now
+    u_int64_t readahead;   // blocks read ahead of sequential streams
+    u_int64_t readahead_hits;  // and how many of them were read afterwards
+  };
+
+  // wrap a backend in a read cache of at most capacity bytes. Pass the
+  // operations returned by buse_cache_operations() to buse_main() along with
+  // the cache itself as userdata; the backend still gets its own userdata.
+  struct buse_cache *buse_cache_create(const struct buse_operations *backend, void *userdata,
+      u_int64_t capacity);
+  const struct buse_operations *buse_cache_operations(struct buse_cache *cache);
+
+  // read sequential streams ahead into the cache from a background thread,
+  // in windows that grow up to max bytes and are rounded to whole stripes
+  // of stripe bytes. Prefetched blocks share the quarter of the cache that
+  // holds blocks read once, so keep max well below that. 0 turns it off.
+  int buse_cache_set_readahead(struct buse_cache *cache, u_int64_t max, u_int64_t stripe);
+
+  void buse_cache_get_stats(struct buse_cache *cache, struct buse_cache_stats *stats);
+  void buse_cache_print_stats(struct buse_cache *cache, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CACHE_H_INCLUDED */
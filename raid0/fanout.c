@@ -0,0 +1,208 @@
+/*
+ * fanout - concurrent member I/O for striped BUSE backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The pieces of a request are chained by member. The caller does the
+ * chain of the first member itself and queues the others to the threads
+ * of their members, then waits for the batch to count down to zero.
+ * Pieces that continue each other on a member go out as one preadv() or
+ * pwritev(), or one hole punched for trims, which block devices take as a
+ * discard.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fanout.h"
+
+#define FANOUT_IOV 64
+
+struct fanout_batch {
+  int pending;  /* chains not done yet */
+  int err;
+};
+
+struct fanout_member {
+  struct buse_fanout *fanout;
+  int fd;
+  pthread_t thread;
+  pthread_cond_t wake;
+  struct buse_fanout_io *jobs, *last_job;  /* chains, linked by next_job */
+};
+
+struct buse_fanout {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int count;
+  struct fanout_member *members;
+};
+
+/* Do a chain of pieces on fd, returns an errno. */
+static int run_chain(int fd, struct buse_fanout_io *io) {
+  struct iovec iov[FANOUT_IOV];
+  u_int64_t total;
+  ssize_t done;
+  int n;
+
+  while (io != NULL) {
+    struct buse_fanout_io *first = io;
+    total = 0;
+    for (n = 0; io != NULL && (n < FANOUT_IOV || first->op == BUSE_FANOUT_TRIM) &&
+        io->op == first->op && io->offset == first->offset + total; io = io->next, n++) {
+      if (n < FANOUT_IOV) {
+        iov[n].iov_base = io->buf;
+        iov[n].iov_len = io->len;
+      }
+      total += io->len;
+    }
+    if (first->op == BUSE_FANOUT_TRIM) {
+      if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first->offset, total) == -1 &&
+          errno != EOPNOTSUPP) {
+        return errno;
+      }
+      continue;
+    }
+    done = first->op == BUSE_FANOUT_WRITE ? pwritev(fd, iov, n, first->offset) :
+        preadv(fd, iov, n, first->offset);
+    if (done < 0) {
+      return errno;
+    }
+    if ((u_int64_t)done != total) {
+      return EIO;
+    }
+  }
+  return 0;
+}
+
+static void finish(struct buse_fanout *fanout, struct fanout_batch *batch, int err) {
+  pthread_mutex_lock(&fanout->lock);
+  if (err != 0 && batch->err == 0) {
+    batch->err = err;
+  }
+  if (--batch->pending == 0) {
+    pthread_cond_broadcast(&fanout->done);
+  }
+  pthread_mutex_unlock(&fanout->lock);
+}
+
+static void *member_thread(void *arg) {
+  struct fanout_member *m = arg;
+  struct buse_fanout *fanout = m->fanout;
+  struct buse_fanout_io *job;
+  sigset_t set;
+
+  /* Signals are for the threads of the program. */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  pthread_mutex_lock(&fanout->lock);
+  for (;;) {
+    while (m->jobs == NULL) {
+      pthread_cond_wait(&m->wake, &fanout->lock);
+    }
+    job = m->jobs;
+    m->jobs = job->next_job;
+    pthread_mutex_unlock(&fanout->lock);
+    finish(fanout, job->batch, run_chain(m->fd, job));
+    pthread_mutex_lock(&fanout->lock);
+  }
+  return NULL;
+}
+
+int buse_fanout_run(struct buse_fanout *fanout, struct buse_fanout_io *ios, int count) {
+  struct buse_fanout_io *heads[count > 0 ? count : 1], **tails[fanout->count];
+  struct fanout_batch batch = { 0, 0 };
+  int nheads = 0, err;
+
+  for (int i = 0; i < fanout->count; i++) {
+    tails[i] = NULL;
+  }
+  for (int i = 0; i < count; i++) {
+    struct buse_fanout_io *io = &ios[i];
+    if (fanout->members[io->member].fd == -1) {
+      return ENXIO;
+    }
+    io->next = NULL;
+    io->batch = &batch;
+    if (tails[io->member] == NULL) {
+      heads[nheads++] = io;
+    } else {
+      *tails[io->member] = io;
+    }
+    tails[io->member] = &io->next;
+  }
+  if (nheads == 0) {
+    return 0;
+  }
+  batch.pending = nheads;
+  if (nheads > 1) {
+    pthread_mutex_lock(&fanout->lock);
+    for (int i = 1; i < nheads; i++) {
+      struct fanout_member *m = &fanout->members[heads[i]->member];
+      heads[i]->next_job = NULL;
+      if (m->jobs == NULL) {
+        m->jobs = heads[i];
+      } else {
+        m->last_job->next_job = heads[i];
+      }
+      m->last_job = heads[i];
+      pthread_cond_signal(&m->wake);
+    }
+    pthread_mutex_unlock(&fanout->lock);
+  }
+  finish(fanout, &batch, run_chain(fanout->members[heads[0]->member].fd, heads[0]));
+  pthread_mutex_lock(&fanout->lock);
+  while (batch.pending > 0) {
+    pthread_cond_wait(&fanout->done, &fanout->lock);
+  }
+  err = batch.err;
+  pthread_mutex_unlock(&fanout->lock);
+  return err;
+}
+
+struct buse_fanout *buse_fanout_create(const int *fds, int count) {
+  struct buse_fanout *fanout = calloc(1, sizeof(*fanout));
+
+  if (fanout == NULL) {
+    return NULL;
+  }
+  fanout->members = calloc(count, sizeof(*fanout->members));
+  if (fanout->members == NULL) {
+    free(fanout);
+    return NULL;
+  }
+  fanout->count = count;
+  pthread_mutex_init(&fanout->lock, NULL);
+  pthread_cond_init(&fanout->done, NULL);
+  for (int i = 0; i < count; i++) {
+    struct fanout_member *m = &fanout->members[i];
+    m->fanout = fanout;
+    m->fd = fds[i];
+    pthread_cond_init(&m->wake, NULL);
+    if (m->fd != -1 && pthread_create(&m->thread, NULL, member_thread, m) != 0) {
+      return NULL;
+    }
+  }
+  return fanout;
+}
@@ -15,6 +15,7 @@
 
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -23,127 +24,233 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "cache.h"
+#include "fanout.h"
+#include "tier.h"
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
-int dev_fd[2]; // file descriptors for two underlying block devices that make up the RAID
-uint32_t block_size;  //NOTE: other than truncating the resulting raid device, block_size is ignored in this program; it is asked for and set in order to make it easier to adapt this code to RAID0/4/5/6.
+int num_devices = 0;
+int dev_fd[16]; // file descriptors for the underlying block devices that make up the RAID
+uint32_t chunk_size; // bytes written to one device before moving on to the next
 uint64_t raid_device_size; // size of raid device in bytes
 bool verbose = false;  // set to true by -v option for debug output
-bool degraded = false; // true if we're missing a device
+struct buse_fanout *fanout; // does the parts of a request on different devices at once
+
+// Devices of different sizes are striped in zones, like md does: the first
+// zone stripes over all devices up to the size of the smallest one, the
+// next over the remaining devices up to the size of the next smallest, and
+// so on. With equal devices there is one zone.
+//
+// Devices can be given weights, so faster ones get more chunks: a cycle of
+// a zone then has as many chunks as the weights of its devices add up to,
+// spread over them as evenly as possible by the pattern table. Once a
+// device has less room left than its weight, the zones that follow fall
+// back to plain striping.
+struct zone_slot {
+    uint8_t index;  // into the devices of the zone
+    uint8_t chunk;  // of the device in the cycle
+};
 
-int ok_dev = -1; // index of dev_fd that has a valid drive (used in degraded mode to identify the non-missing drive (0 or 1))
-int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
+struct zone {
+    uint64_t start;           // offset of the zone in the RAID
+    int num_devices;
+    int device[16];           // indices into dev_fd
+    uint64_t dev_start[16];   // where the zone starts on each of them
+    uint32_t weight[16];
+    uint32_t cycle;           // chunks in a cycle
+    int cycle_shift;          // log2 of cycle if it is a power of two, else -1
+    struct zone_slot pattern[16 * 16];
+};
 
-int last_read_dev = 0; // used to interleave reading between the two devices
-const int num_device = 2;
+#define MAX_WEIGHT 16
+
+// a weighted zone leaves some device with less than its weight, and the
+// plain zone after it uses that device up, so there are at most two zones
+// per device
+struct zone zones[2 * 16];
+int num_zones = 0;
+uint32_t weights[16]; // chunks per cycle of each device, 1 unless given
+
+// with a power-of-two chunk size the mapping shifts and masks instead of dividing
+int chunk_shift = -1;
+
+static int log2_exact(uint64_t n) {
+    int shift = 0;
+    if (n == 0 || (n & (n - 1)) != 0)
+        return -1;
+    while ((1ULL << shift) != n)
+        shift++;
+    return shift;
+}
 
-static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
-    fprintf(stderr, "\n\n");
-    UNUSED(userdata);
-    if (verbose)
-        fprintf(stderr, "R - %lu, %u\n", offset, len);
-    
-    u_int32_t start_blk_num = offset / block_size;
-    u_int64_t start_blk_offset = offset % block_size;
-    u_int32_t drive_num = start_blk_num % num_device;
-    u_int32_t block_idx = start_blk_num / num_device;
+// spread the chunks of a cycle over the devices of a zone in proportion
+// to their weights, by smooth weighted round-robin
+static void build_pattern(struct zone *z) {
+    int64_t current[16] = {0};
+    uint8_t used[16] = {0};
+
+    z->cycle = 0;
+    for (int i = 0; i < z->num_devices; i++)
+        z->cycle += z->weight[i];
+    for (uint32_t k = 0; k < z->cycle; k++) {
+        int best = 0;
+        for (int i = 0; i < z->num_devices; i++) {
+            current[i] += z->weight[i];
+            if (current[i] > current[best])
+                best = i;
+        }
+        current[best] -= z->cycle;
+        z->pattern[k].index = best;
+        z->pattern[k].chunk = used[best]++;
+    }
+    z->cycle_shift = log2_exact(z->cycle);
+}
 
-    
-    fprintf(stderr, "start_blk_num: %u\n", start_blk_num);
-    fprintf(stderr, "start_blk_offset: %lu\n", start_blk_offset);
-    fprintf(stderr, "drive_num: %u\n", drive_num);
-    fprintf(stderr, "block_idx: %u\n", block_idx);
-
-    if(len <= block_size - start_blk_offset) {
-        pread(dev_fd[drive_num], buf, len, block_idx * block_size + start_blk_offset);
-        fprintf(stderr, "pread called: drive_num: %d, len: %u, offset: %lu\n", drive_num, len, block_idx * block_size + start_blk_offset);
-    } else {
-        pread(dev_fd[drive_num], buf, block_size - start_blk_offset, block_idx * block_size + start_blk_offset);
-        fprintf(stderr, "pread called: drive_num: %d, len: %lu, offset: %lu\n", drive_num, block_size - start_blk_offset, block_idx * block_size + start_blk_offset);
-        buf += block_size - start_blk_offset;           // ?????????? is that correct?
-        len -= block_size - start_blk_offset;
-        start_blk_num++;
-        while(len > 0) {
-            drive_num = start_blk_num % num_device;
-            block_idx = start_blk_num / num_device;
-            if(len <= block_size) {
-                pread(dev_fd[drive_num], buf, len, block_idx * block_size);
-                fprintf(stderr, "pread called: drive_num: %d, len: %u, offset: %u\n", drive_num, len, block_idx * block_size);
-                len = 0;
-            } else {
-                pread(dev_fd[drive_num], buf, block_size, block_idx * block_size);
-                fprintf(stderr, "pread called: drive_num: %d, len: %u, offset: %u\n", drive_num, block_size, block_idx * block_size);
-                buf += block_size;
-                len -= block_size;
-                start_blk_num++;
+// lay out the zones over devices with the given number of chunks, returns
+// the RAID size
+static uint64_t build_zones(const uint64_t *chunks) {
+    uint64_t start = 0, used[16] = {0};
+
+    for (;;) {
+        struct zone *z;
+        uint64_t cycles = 0;
+        bool plain = false;
+        bool left = false;
+
+        for (int i = 0; i < num_devices; i++)
+            left |= chunks[i] > used[i];
+        if (!left)
+            return start;
+        assert(num_zones < (int)(sizeof(zones) / sizeof(zones[0])));
+        z = &zones[num_zones];
+
+        // the zone ends where the first of the devices still left fills up
+        z->num_devices = 0;
+        for (int i = 0; i < num_devices; i++) {
+            if (chunks[i] > used[i]) {
+                uint64_t n = (chunks[i] - used[i]) / weights[i];
+                if (z->num_devices == 0 || n < cycles)
+                    cycles = n;
+                z->device[z->num_devices++] = i;
+            }
+        }
+        if (cycles == 0) {
+            plain = true;
+            for (int j = 0; j < z->num_devices; j++) {
+                uint64_t n = chunks[z->device[j]] - used[z->device[j]];
+                if (j == 0 || n < cycles)
+                    cycles = n;
             }
-        }    
+        }
+        for (int j = 0; j < z->num_devices; j++) {
+            int i = z->device[j];
+            z->weight[j] = plain ? 1 : weights[i];
+            z->dev_start[j] = used[i] * chunk_size;
+            used[i] += cycles * z->weight[j];
+        }
+        build_pattern(z);
+        z->start = start;
+        start += cycles * z->cycle * chunk_size;
+        num_zones++;
     }
+}
 
-    fprintf(stderr, "\n\n");
+// find the device holding byte offset of the RAID and the offset there;
+// returns how many bytes from offset on are in the same chunk
+static uint32_t map_offset(uint64_t offset, int *device, u_int64_t *device_offset) {
+    uint64_t chunk, in_chunk, cycle, k;
+    int lo = 0, hi = num_zones - 1;
+
+    // the last zone starting at or before offset
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (zones[mid].start <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    const struct zone *z = &zones[lo];
+    offset -= z->start;
 
-    return 0;
+    if (chunk_shift >= 0) {
+        chunk = offset >> chunk_shift;
+        in_chunk = offset & (chunk_size - 1);
+    } else {
+        chunk = offset / chunk_size;
+        in_chunk = offset % chunk_size;
+    }
+    if (z->cycle_shift >= 0) {
+        cycle = chunk >> z->cycle_shift;
+        k = chunk & (z->cycle - 1);
+    } else {
+        cycle = chunk / z->cycle;
+        k = chunk % z->cycle;
+    }
+    const struct zone_slot *slot = &z->pattern[k];
+    uint64_t dev_chunk = cycle * z->weight[slot->index] + slot->chunk;
+    *device = z->device[slot->index];
+    *device_offset = z->dev_start[slot->index] + (chunk_shift >= 0 ? dev_chunk << chunk_shift : dev_chunk * chunk_size) + in_chunk;
+    return chunk_size - in_chunk;
+}
+
+// split a request into its chunks and do them, all devices at once
+static int do_io(char *buf, u_int32_t len, u_int64_t offset, bool write) {
+    struct buse_fanout_io on_stack[64], *ios = on_stack;
+    int count = 0, ret;
+    uint32_t max = len / chunk_size + 2;
+
+    if (max > 64) {
+        ios = malloc(max * sizeof(*ios));
+        if (ios == NULL)
+            return ENOMEM;
+    }
+    while (len > 0) {
+        struct buse_fanout_io *io = &ios[count++];
+        uint32_t piece = map_offset(offset, &io->member, &io->offset);
+        if (piece > len)
+            piece = len;
+        io->op = write ? BUSE_FANOUT_WRITE : BUSE_FANOUT_READ;
+        io->buf = buf;
+        io->len = piece;
+        if (verbose)
+            fprintf(stderr, "%s device %d, len %u, offset %lu\n", write ? "pwrite" : "pread", io->member, piece, io->offset);
+        buf += piece;
+        offset += piece;
+        len -= piece;
+    }
+    ret = buse_fanout_run(fanout, ios, count);
+    if (ios != on_stack)
+        free(ios);
+    return ret;
+}
+
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+    UNUSED(userdata);
+    if (verbose)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+    return do_io(buf, len, offset, false);
 }
 
 static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
-    fprintf(stderr, "\n\n");
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "W - %lu, %u\n", offset, len);
-    
-    u_int32_t start_blk_num = offset / block_size;
-    u_int64_t start_blk_offset = offset % block_size;
-    u_int32_t drive_num = start_blk_num % num_device;
-    u_int32_t block_idx = start_blk_num / num_device;
-
-    fprintf(stderr, "start_blk_num: %u\n", start_blk_num);
-    fprintf(stderr, "start_blk_offset: %lu\n", start_blk_offset);
-    fprintf(stderr, "drive_num: %u\n", drive_num);
-    fprintf(stderr, "block_idx: %u\n", block_idx);
-
-    if(len <= block_size - start_blk_offset) {
-        pwrite(dev_fd[drive_num], buf, len, block_idx * block_size + start_blk_offset); 
-        fprintf(stderr, "pwrite called: drive_num: %d, len: %u, offset: %lu\n", drive_num, len, block_idx * block_size + start_blk_offset);
-    } else {
-        pwrite(dev_fd[drive_num], buf, block_size - start_blk_offset, block_idx * block_size + start_blk_offset); 
-        fprintf(stderr, "pwrite called: drive_num: %d, len: %lu, offset: %lu\n", drive_num, block_size - start_blk_offset, block_idx * block_size + start_blk_offset);
-        buf += block_size - start_blk_offset;
-        len -= block_size - start_blk_offset;
-        start_blk_num++;
-        while(len > 0) {
-            drive_num = start_blk_num % num_device;
-            block_idx = start_blk_num / num_device;
-            if(len <= block_size) {
-                pwrite(dev_fd[drive_num], buf, len, block_idx * block_size);
-                fprintf(stderr, "pwrite called: drive_num: %d, len: %u, offset: %u\n", drive_num, len, block_idx * block_size);
-                len = 0;
-            } else {
-                pwrite(dev_fd[drive_num], buf, block_size, block_idx * block_size);
-                fprintf(stderr, "pwrite called: drive_num: %d, len: %u, offset: %u\n", drive_num, block_size, block_idx * block_size);
-                buf += block_size;
-                len -= block_size;
-                start_blk_num++;
-            }
-        }    
-    }
-    fprintf(stderr, "\n\n");
-
-    return 0;
+    return do_io((char *)buf, len, offset, true);
 }
 
 static int xmp_flush(void *userdata) {
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a flush request.\n");
-    for (int i=0; i<2; i++) {
-        if (dev_fd[i] != -1) { // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
-        }
+    for (int i=0; i<num_devices; i++) {
+        if (fsync(dev_fd[i]) != 0) // we use fsync to flush OS buffers to underlying devices
+            return errno;
     }
     return 0;
 }
@@ -155,35 +262,87 @@ static void xmp_disc(void *userdata) {
     // disconnect is a no-op for us
 }
 
-/*
-// we'll disable trim support, you can add it back if you want it
+// the chunks of a trim that follow each other on a device are merged, so
+// each device gets one discard, and all devices get theirs at once
 static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
+    struct buse_fanout_io ios[32], *last[16] = {NULL};
+    int count = 0, ret;
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "T - %lu, %u\n", from, len);
-    // trim is a no-op for us
-    return 0;
+
+    while (len > 0) {
+        int device;
+        u_int64_t device_offset;
+        uint32_t piece = map_offset(from, &device, &device_offset);
+        if (piece > len)
+            piece = len;
+        struct buse_fanout_io *io = last[device];
+        if (io != NULL && io->offset + io->len == device_offset) {
+            io->len += piece;
+        } else {
+            if (count == 32) {
+                ret = buse_fanout_run(fanout, ios, count);
+                if (ret != 0)
+                    return ret;
+                count = 0;
+                memset(last, 0, sizeof(last));
+            }
+            io = &ios[count++];
+            io->member = device;
+            io->op = BUSE_FANOUT_TRIM;
+            io->buf = NULL;
+            io->offset = device_offset;
+            io->len = piece;
+            last[device] = io;
+        }
+        from += piece;
+        len -= piece;
+    }
+    return buse_fanout_run(fanout, ios, count);
 }
-*/
 
 /* argument parsing using argp */
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"weights", 'p', "W1,W2,...", 0, "Give each device this many chunks per cycle (1 to 16), for example more to faster ones; the weights are part of the layout", 0},
+    {"benchmark", 'b', 0, 0, "Measure how fast each device reads, print weights for --weights and exit", 0},
+    {"readahead", 'r', "SIZE", 0, "Read sequential streams up to SIZE bytes ahead into a cache of 16 times SIZE (suffixes K, M, G)", 0},
+    {"ssd", 's', "FILE", 0, "Keep the most used blocks on the fast device or file FILE", 0},
+    {"ssd-writeback", 'W', 0, 0, "Write to blocks on the fast device only, and write them back later", 0},
     {0},
 };
 
 struct arguments {
-    uint32_t block_size;
-    char* device[2];
+    uint32_t chunk_size;
+    char* device[16];
     char* raid_device;
     int verbose;
+    char* ssd;
+    int ssd_writeback;
+    unsigned long long readahead;
+    char* weights;
+    int benchmark;
 };
 
+/* A size in bytes with an optional K, M or G suffix, 0 if it isn't one. */
+static unsigned long long parse_size(const char *arg) {
+    char *endptr;
+    unsigned long long size = strtoull(arg, &endptr, 10);
+
+    switch (*endptr) {
+        case 'G': size <<= 10; /* fall through */
+        case 'M': size <<= 10; /* fall through */
+        case 'K': size <<= 10; endptr++; break;
+    }
+    return *endptr == '\0' ? size : 0;
+}
+
 /* Parse a single option. */
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
-    char * endptr;
+    unsigned long long size;
 
     switch (key) {
 
@@ -191,38 +350,57 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
+        case 'p':
+            arguments->weights = arg;
+            break;
+
+        case 'b':
+            arguments->benchmark = 1;
+            break;
+
+        case 'r':
+            arguments->readahead = parse_size(arg);
+            if (arguments->readahead == 0) {
+                errx(EXIT_FAILURE, "readahead SIZE must be a positive integer");
+            }
+            break;
+
+        case 's':
+            arguments->ssd = arg;
+            break;
+
+        case 'W':
+            arguments->ssd_writeback = 1;
+            break;
+
         case ARGP_KEY_ARG:
             switch (state->arg_num) {
 
                 case 0:
-                    arguments->block_size = strtoul(arg, &endptr, 10);
-                    if (*endptr != '\0') {
-                        /* failed to parse integer */
-                        errx(EXIT_FAILURE, "SIZE must be an integer");
+                    size = parse_size(arg);
+                    if (size == 0 || size > 1ULL << 30) {
+                        errx(EXIT_FAILURE, "CHUNKSIZE must be a positive integer of at most 1G");
                     }
+                    arguments->chunk_size = size;
                     break;
 
                 case 1:
                     arguments->raid_device = arg;
                     break;
 
-                case 2:
-                    arguments->device[0] = arg;
-                    break;
-
-                case 3:
-                    arguments->device[1] = arg;
-                    break;
-                    
                 default:
-                    /* Too many arguments. */
-                    return ARGP_ERR_UNKNOWN;
+                    if (state->arg_num <= 17) {
+                        num_devices = state->arg_num - 1;
+                        arguments->device[state->arg_num-2] = arg;
+                    } else {
+                        return ARGP_ERR_UNKNOWN;
+                    }
             }
             break;
 
         case ARGP_KEY_END:
-            if (state->arg_num < 3) {
-                warnx("not enough arguments");
+            if (state->arg_num < 4) {
+                warnx("Wrong argument number! Drive numbers should between 2 and 16");
                 argp_usage(state);
             }
             break;
@@ -236,16 +414,82 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp argp = {
     .options = options,
     .parser = parse_opt,
-    .args_doc = "BLOCKSIZE RAIDDEVICE DEVICE1 DEVICE2",
-    .doc = "BUSE implementation of RAID0 for two devices.\n"
-           "`BLOCKSIZE` is an integer number of bytes. "
+    .args_doc = "CHUNKSIZE RAIDDEVICE DEVICE1 DEVICE2 ...",
+    .doc = "BUSE implementation of RAID0 for 2 ~ 16 devices.\n"
+           "`CHUNKSIZE` is the number of bytes (suffixes K, M, G) written to one device before moving on to the next; "
+           "powers of two are mapped fastest. "
            "\n\n"
            "`RAIDDEVICE` is a path to an NBD block device, for example \"/dev/nbd0\"."
            "\n\n"
            "`DEVICE*` is a path to underlying block devices. Normal files can be used too. "
+           "Devices of different sizes are all used up: the space beyond the smallest one is striped over the larger ones. "
            "\n\n"
 };
 
+/* Parse the weights of the devices, a comma separated list. */
+static void parse_weights(const char *arg) {
+    char *endptr;
+    int i = 0;
+
+    for (;;) {
+        unsigned long w = strtoul(arg, &endptr, 10);
+        if (endptr == arg || w < 1 || w > MAX_WEIGHT || i == num_devices)
+            errx(EXIT_FAILURE, "WEIGHTS must be %d integers from 1 to %d", num_devices, MAX_WEIGHT);
+        weights[i++] = w;
+        if (*endptr == '\0')
+            break;
+        if (*endptr != ',')
+            errx(EXIT_FAILURE, "WEIGHTS must be separated by commas");
+        arg = endptr + 1;
+    }
+    if (i != num_devices)
+        errx(EXIT_FAILURE, "WEIGHTS must be %d integers from 1 to %d", num_devices, MAX_WEIGHT);
+}
+
+/* Time reads of 1M at random places of each device, bypassing the page
+ * cache where possible, and print weights in proportion to the rates. */
+#define BENCH_READS 64
+#define BENCH_SIZE (1 << 20)
+
+static void benchmark(char **paths) {
+    double rate[16], slowest = 0;
+    void *buf;
+
+    if (posix_memalign(&buf, 4096, BENCH_SIZE) != 0)
+        errx(EXIT_FAILURE, "out of memory");
+    for (int i = 0; i < num_devices; i++) {
+        int fd = open(paths[i], O_RDONLY | O_DIRECT);
+        if (fd < 0)
+            fd = open(paths[i], O_RDONLY);
+        if (fd < 0)
+            err(EXIT_FAILURE, "%s", paths[i]);
+        uint64_t blocks = lseek(fd, 0, SEEK_END) / BENCH_SIZE;
+        if (blocks == 0)
+            errx(EXIT_FAILURE, "%s is too small to measure", paths[i]);
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int n = 0; n < BENCH_READS; n++) {
+            uint64_t block = ((uint64_t)rand() * RAND_MAX + rand()) % blocks;
+            if (pread(fd, buf, BENCH_SIZE, block * BENCH_SIZE) != BENCH_SIZE)
+                err(EXIT_FAILURE, "reading %s", paths[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        close(fd);
+        double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        rate[i] = (double)BENCH_READS * BENCH_SIZE / (secs > 0 ? secs : 1e-9);
+        if (slowest == 0 || rate[i] < slowest)
+            slowest = rate[i];
+        fprintf(stderr, "Device '%s' reads %.0f MB/s.\n", paths[i], rate[i] / (1 << 20));
+    }
+    free(buf);
+    printf("--weights=");
+    for (int i = 0; i < num_devices; i++) {
+        long w = (long)(rate[i] / slowest + 0.5);
+        printf("%s%ld", i ? "," : "", w > MAX_WEIGHT ? MAX_WEIGHT : w);
+    }
+    printf("\n");
+}
+
 int main(int argc, char *argv[]) {
     struct arguments arguments = {
         .verbose = 0,
@@ -257,18 +501,24 @@ int main(int argc, char *argv[]) {
         .write = xmp_write,
         .disc = xmp_disc,
         .flush = xmp_flush,
-        // .trim = xmp_trim, // we'll disable trim support, you can add it back if you want it
+        .trim = xmp_trim,
     };
 
     verbose = arguments.verbose;
-    block_size = arguments.block_size;
-    
-    raid_device_size=0; // will be detected from the drives available
-    ok_dev=-1;
+    chunk_size = arguments.chunk_size;
+    chunk_shift = log2_exact(chunk_size);
+    if (arguments.benchmark) {
+        benchmark(arguments.device);
+        return 0;
+    }
+    for (int i=0; i<num_devices; i++)
+        weights[i] = 1;
+    if (arguments.weights)
+        parse_weights(arguments.weights);
 
-    for (int i=0; i<2; i++) {
+    uint64_t chunks[16];
+    for (int i=0; i<num_devices; i++) {
         char* dev_path = arguments.device[i];
-        ok_dev = i;
         dev_fd[i] = open(dev_path,O_RDWR);
         if (dev_fd[i] < 0) {
             perror(dev_path);
@@ -276,15 +526,65 @@ int main(int argc, char *argv[]) {
         }
         uint64_t size = lseek(dev_fd[i],0,SEEK_END); // used to find device size by seeking to end
         fprintf(stderr, "Got device '%s', size %ld bytes.\n", dev_path, size);
-        if (raid_device_size==0 || size<raid_device_size) {
-            raid_device_size = size; // raid_device_size is minimum size of available devices
-        }  
+        chunks[i] = size/chunk_size; // only whole chunks are used
+    }
+
+    raid_device_size = build_zones(chunks);
+    if (raid_device_size == 0) {
+        fprintf(stderr, "ERROR: All devices are smaller than a chunk.\n");
+        exit(1);
     }
-    
-    raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
     bop.size = raid_device_size; // tell BUSE how big our block device is
-    
+    for (int i=0; i<num_zones; i++) {
+        fprintf(stderr, "Zone %d: from %lu, striped over %d devices in cycles of %u chunks.\n",
+                i, zones[i].start, zones[i].num_devices, zones[i].cycle);
+    }
+
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
-    
+
+    fanout = buse_fanout_create(dev_fd, num_devices);
+    if (fanout == NULL) {
+        fprintf(stderr, "ERROR: Could not start the device threads.\n");
+        exit(1);
+    }
+
+    if (arguments.ssd || arguments.readahead) {
+        const struct buse_operations *ops = &bop;
+        void *userdata = NULL;
+        struct buse_tier *tier = NULL;
+        struct buse_cache *cache = NULL;
+
+        if (arguments.ssd) {
+            tier = buse_tier_create(ops, userdata, arguments.ssd, arguments.ssd_writeback);
+            if (tier == NULL) {
+                fprintf(stderr, "ERROR: Could not set up the fast device '%s': %s.\n", arguments.ssd, strerror(errno));
+                exit(1);
+            }
+            ops = buse_tier_operations(tier);
+            userdata = tier;
+        }
+        if (arguments.readahead) {
+            // read ahead whole stripes, so all drives are read from
+            cache = buse_cache_create(ops, userdata, arguments.readahead * 16);
+            if (cache == NULL ||
+                buse_cache_set_readahead(cache, arguments.readahead, (u_int64_t)chunk_size * zones[0].cycle) != 0) {
+                fprintf(stderr, "ERROR: Could not set up reading ahead.\n");
+                exit(1);
+            }
+            ops = buse_cache_operations(cache);
+            userdata = cache;
+        }
+        int ret = buse_main(arguments.raid_device, ops, userdata);
+        if (tier && buse_tier_close(tier) != 0) {
+            fprintf(stderr, "ERROR: Could not save the state of the fast device.\n");
+            ret = 1;
+        }
+        if (tier)
+            buse_tier_print_stats(tier, stderr);
+        if (cache)
+            buse_cache_print_stats(cache, stderr);
+        return ret;
+    }
+
     return buse_main(arguments.raid_device, &bop, NULL);
 }
@@ -0,0 +1,51 @@
+#ifndef TIER_H_INCLUDED
+#define TIER_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "buse.h"
+
+  /* Granularity of the tier. */
+#define BUSE_TIER_BLOCK_SIZE (64 * 1024)
+
+  struct buse_tier;
+
+  struct buse_tier_stats {
+    u_int64_t read_hits;    // blocks read from the fast device
+    u_int64_t read_misses;  // blocks read from the backend
+    u_int64_t write_hits;   // blocks written to the fast device
+    u_int64_t write_misses;
+    u_int64_t bypassed;     // blocks of sequential streams, which aren't promoted
+    u_int64_t promotions;
+    u_int64_t evictions;
+    u_int64_t cleaned;      // dirty blocks written back to the backend
+    u_int64_t cached;       // blocks held right now
+    u_int64_t dirty;        // and how many of them the backend doesn't have yet
+  };
+
+  // keep the blocks of a backend that are used most on a fast device or
+  // file at path, which keeps its contents across restarts. With writeback
+  // set, writes to cached blocks only go to the fast device and are written
+  // back in the background, otherwise they go to both. Use it like
+  // buse_cache_create(); returns NULL with errno set on failure.
+  struct buse_tier *buse_tier_create(const struct buse_operations *backend, void *userdata,
+      const char *path, int writeback);
+  const struct buse_operations *buse_tier_operations(struct buse_tier *tier);
+
+  // stop the background thread and save the metadata, so the next
+  // buse_tier_create() starts with the same blocks cached.
+  int buse_tier_close(struct buse_tier *tier);
+
+  void buse_tier_get_stats(struct buse_tier *tier, struct buse_tier_stats *stats);
+  void buse_tier_print_stats(struct buse_tier *tier, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIER_H_INCLUDED */
@@ -25,6 +25,8 @@
 #include <fcntl.h>
 #include <linux/nbd.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +34,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -89,52 +92,256 @@ static int write_all(int fd, char* buf, size_t count)
   return 0;
 }
 
-/* Signal handler to gracefully disconnect from nbd kernel driver. */
-static int nbd_dev_to_disconnect = -1;
+/* Signal handler to gracefully disconnect from nbd kernel driver. A process
+ * may serve several devices, each from its own buse_main() call; the slots
+ * hold the nbd file descriptor plus one, zero when free. */
+#define BUSE_MAX_DEVICES 16
+static volatile int nbd_devs_to_disconnect[BUSE_MAX_DEVICES];
 static void disconnect_nbd(int signal) {
   (void)signal;
-  if (nbd_dev_to_disconnect != -1) {
-    if(ioctl(nbd_dev_to_disconnect, NBD_DISCONNECT) == -1) {
+  for (int i = 0; i < BUSE_MAX_DEVICES; i++) {
+    int nbd = nbd_devs_to_disconnect[i] - 1;
+    if (nbd == -1) {
+      continue;
+    }
+    if(ioctl(nbd, NBD_DISCONNECT) == -1) {
       warn("failed to request disconect on nbd device");
     } else {
-      nbd_dev_to_disconnect = -1;
+      nbd_devs_to_disconnect[i] = 0;
       fprintf(stderr, "sucessfuly requested disconnect on nbd device\n");
     }
   }
 }
 
+/* Registers nbd to be disconnected on termination signals. */
+static int add_nbd_to_disconnect(int nbd) {
+  for (int i = 0; i < BUSE_MAX_DEVICES; i++) {
+    if (__sync_bool_compare_and_swap(&nbd_devs_to_disconnect[i], 0, nbd + 1)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 /* Sets signal action like regular sigaction but is suspicious. */
 static int set_sigaction(int sig, const struct sigaction * act) {
   struct sigaction oact;
   int r = sigaction(sig, act, &oact);
-  if (r == 0 && oact.sa_handler != SIG_DFL) {
+  if (r == 0 && oact.sa_handler != SIG_DFL && oact.sa_handler != act->sa_handler) {
     warnx("overriden non-default signal handler (%d: %s)", sig, strsignal(sig));
   }
   return r;
 }
 
-/* Serve userland side of nbd socket. If everything worked ok, return 0. */
-static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata) {
+/* State shared by the threads serving one nbd socket. */
+struct buse_server {
+  int sk;
+  const struct buse_operations *aop;
+  void *userdata;
+  pthread_mutex_t rx_lock; /* held while reading a request off the socket */
+  pthread_mutex_t tx_lock; /* held while writing a reply to the socket */
+  int done;                /* set once no more requests should be read */
+  int disconnected;        /* set when NBD_CMD_DISC was received */
+  int status;
+  int ctl;                 /* listening handover socket, or -1 */
+  int successor;           /* connection of the process taking over, or -1 */
+  u_int32_t started;       /* number of workers started, hands out indexes */
+  pthread_mutex_t async_lock;
+  pthread_cond_t async_idle;
+  u_int32_t inflight;      /* requests submitted but not completed yet */
+};
+
+/* An asynchronous request, until buse_complete() answers it. */
+struct buse_async {
+  struct buse_request req;
+  struct buse_server *srv;
+  char handle[8];
+};
+
+/* Each worker keeps its request buffer for the next request, as long as it
+ * is at most BUSE_BUFFER_KEEP bytes. Buffers are page aligned, so backends
+ * may hand them to O_DIRECT I/O. */
+#define BUSE_BUFFER_ALIGN 4096
+#define BUSE_BUFFER_KEEP (1 << 20)
+
+struct buse_buffer {
+  void *data;
+  u_int32_t size;
+};
+
+static void *get_buffer(struct buse_buffer *buf, u_int32_t len) {
+  u_int32_t size = (len + BUSE_BUFFER_ALIGN - 1) & ~(BUSE_BUFFER_ALIGN - 1);
+  void *data;
+
+  if (len <= buf->size) {
+    return buf->data;
+  }
+  if (posix_memalign(&data, BUSE_BUFFER_ALIGN, size) != 0) {
+    return NULL;
+  }
+  if (size <= BUSE_BUFFER_KEEP) {
+    free(buf->data);
+    buf->data = data;
+    buf->size = size;
+  }
+  return data;
+}
+
+static void put_buffer(struct buse_buffer *buf, void *data) {
+  if (data != buf->data) {
+    free(data);
+  }
+}
+
+static struct buse_async *new_async(struct buse_server *srv, const struct nbd_request *request,
+    int write, u_int32_t len, u_int64_t from) {
+  struct buse_async *async = malloc(sizeof(*async));
+
+  assert(async != NULL);
+  if (posix_memalign(&async->req.buf, BUSE_BUFFER_ALIGN, len ? len : 1) != 0) {
+    assert(0);
+  }
+  async->req.write = write;
+  async->req.len = len;
+  async->req.offset = from;
+  async->req.priv = NULL;
+  async->srv = srv;
+  memcpy(async->handle, request->handle, sizeof(async->handle));
+  pthread_mutex_lock(&srv->async_lock);
+  srv->inflight++;
+  pthread_mutex_unlock(&srv->async_lock);
+  return async;
+}
+
+void buse_complete(struct buse_request *req, int error) {
+  struct buse_async *async = (struct buse_async *)req;
+  struct buse_server *srv = async->srv;
+  struct nbd_reply reply;
+
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  reply.error = htonl(error);
+  memcpy(reply.handle, async->handle, sizeof(reply.handle));
+  pthread_mutex_lock(&srv->tx_lock);
+  write_all(srv->sk, (char*)&reply, sizeof(struct nbd_reply));
+  if (!req->write && error == 0) {
+    write_all(srv->sk, (char*)req->buf, req->len);
+  }
+  pthread_mutex_unlock(&srv->tx_lock);
+  free(req->buf);
+  free(async);
+
+  pthread_mutex_lock(&srv->async_lock);
+  if (--srv->inflight == 0) {
+    pthread_cond_broadcast(&srv->async_idle);
+  }
+  pthread_mutex_unlock(&srv->async_lock);
+}
+
+/* Wait until a request arrives or a successor connects to the handover
+ * socket. Returns 1 if we should stop serving and hand over. */
+static int wait_request(struct buse_server *srv) {
+  struct pollfd pfd[2] = {
+    { .fd = srv->sk, .events = POLLIN },
+    { .fd = srv->ctl, .events = POLLIN },
+  };
+
+  if (srv->ctl == -1) {
+    return 0;
+  }
+  while (poll(pfd, 2, -1) == -1) {
+    if (errno != EINTR) {
+      warn("failed to poll nbd socket");
+      return 0;
+    }
+  }
+  if (pfd[1].revents & POLLIN) {
+    srv->successor = accept(srv->ctl, NULL, NULL);
+    if (srv->successor == -1) {
+      warn("failed to accept handover connection");
+      return 0;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/* Worker loop: take the next request off the socket, run it and reply.
+ * Requests are read one at a time under rx_lock, but executed concurrently
+ * when several workers are running. */
+static void *serve_worker(void *arg) {
+  struct buse_server *srv = arg;
+  const struct buse_operations *aop = srv->aop;
+  void *userdata = srv->userdata;
+  int sk = srv->sk;
   u_int64_t from;
-  u_int32_t len;
+  u_int32_t len, type, cmd_flags;
   ssize_t bytes_read;
   struct nbd_request request;
   struct nbd_reply reply;
+  struct buse_buffer buf = { NULL, 0 };
+  struct buse_async *async;
   void *chunk;
 
   reply.magic = htonl(NBD_REPLY_MAGIC);
-  reply.error = htonl(0);
+  if (aop->thread_init) {
+    aop->thread_init(__sync_fetch_and_add(&srv->started, 1), userdata);
+  }
 
-  while ((bytes_read = read(sk, &request, sizeof(request))) > 0) {
+  for (;;) {
+    pthread_mutex_lock(&srv->rx_lock);
+    if (srv->done || wait_request(srv)) {
+      srv->done = 1;
+      pthread_mutex_unlock(&srv->rx_lock);
+      break;
+    }
+    bytes_read = read(sk, &request, sizeof(request));
+    if (bytes_read <= 0) {
+      if (bytes_read == -1) {
+        warn("error reading userside of nbd socket");
+        srv->status = EXIT_FAILURE;
+      }
+      srv->done = 1;
+      pthread_mutex_unlock(&srv->rx_lock);
+      break;
+    }
     assert(bytes_read == sizeof(request));
-    memcpy(reply.handle, request.handle, sizeof(reply.handle));
-    reply.error = htonl(0);
+    assert(request.magic == htonl(NBD_REQUEST_MAGIC));
 
     len = ntohl(request.len);
     from = ntohll(request.from);
-    assert(request.magic == htonl(NBD_REQUEST_MAGIC));
+    type = ntohl(request.type);
+    /* Command flags are in the upper half of the type. */
+    cmd_flags = type & 0xffff0000;
+    type &= 0xffff;
+    chunk = NULL;
+    async = NULL;
+    if (aop->submit && (type == NBD_CMD_READ || type == NBD_CMD_WRITE)) {
+      async = new_async(srv, &request, type == NBD_CMD_WRITE, len, from);
+    }
+    if (type == NBD_CMD_WRITE) {
+      if (BUSE_DEBUG) fprintf(stderr, "Request for write of size %d\n", len);
+      chunk = async ? async->req.buf : get_buffer(&buf, len);
+      assert(chunk != NULL);
+      read_all(sk, chunk, len);
+    } else if (type == NBD_CMD_DISC) {
+      if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_DISC\n");
+      /* The disconnect is handled once all workers are finished. */
+      srv->disconnected = 1;
+      srv->done = 1;
+    }
+    pthread_mutex_unlock(&srv->rx_lock);
+    if (type == NBD_CMD_DISC) {
+      break;
+    }
+    if (async) {
+      aop->submit(&async->req, userdata);
+      continue;
+    }
+
+    memcpy(reply.handle, request.handle, sizeof(reply.handle));
+    reply.error = htonl(0);
 
-    switch(ntohl(request.type)) {
+    switch(type) {
       /* I may at some point need to deal with the the fact that the
        * official nbd server has a maximum buffer size, and divides up
        * oversized requests into multiple pieces. This applies to reads
@@ -143,45 +350,51 @@ static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata
     case NBD_CMD_READ:
       if (BUSE_DEBUG) fprintf(stderr, "Request for read of size %d\n", len);
       /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
+      chunk = get_buffer(&buf, len);
+      assert(chunk != NULL);
       if (aop->read) {
         reply.error = aop->read(chunk, len, from, userdata);
       } else {
         /* If user not specified read operation, return EPERM error */
         reply.error = htonl(EPERM);
       }
+      pthread_mutex_lock(&srv->tx_lock);
       write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char*)chunk, len);
+      /* The kernel doesn't expect any data after an error. */
+      if (reply.error == 0) {
+        write_all(sk, (char*)chunk, len);
+      }
+      pthread_mutex_unlock(&srv->tx_lock);
 
-      free(chunk);
+      put_buffer(&buf, chunk);
       break;
     case NBD_CMD_WRITE:
-      if (BUSE_DEBUG) fprintf(stderr, "Request for write of size %d\n", len);
-      chunk = malloc(len);
-      read_all(sk, chunk, len);
       if (aop->write) {
         reply.error = aop->write(chunk, len, from, userdata);
+#ifdef NBD_CMD_FLAG_FUA
+        /* Forced unit access: the data has to be stable before the reply. */
+        if (reply.error == 0 && (cmd_flags & NBD_CMD_FLAG_FUA) && aop->flush) {
+          reply.error = aop->flush(userdata);
+        }
+#endif
       } else {
         /* If user not specified write operation, return EPERM error */
         reply.error = htonl(EPERM);
       }
-      free(chunk);
+      put_buffer(&buf, chunk);
+      pthread_mutex_lock(&srv->tx_lock);
       write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      pthread_mutex_unlock(&srv->tx_lock);
       break;
-    case NBD_CMD_DISC:
-      if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_DISC\n");
-      /* Handle a disconnect request. */
-      if (aop->disc) {
-        aop->disc(userdata);
-      }
-      return EXIT_SUCCESS;
 #ifdef NBD_FLAG_SEND_FLUSH
     case NBD_CMD_FLUSH:
       if (BUSE_DEBUG) fprintf(stderr, "Got NBD_CMD_FLUSH\n");
       if (aop->flush) {
         reply.error = aop->flush(userdata);
       }
+      pthread_mutex_lock(&srv->tx_lock);
       write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      pthread_mutex_unlock(&srv->tx_lock);
       break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
@@ -190,24 +403,201 @@ static int serve_nbd(int sk, const struct buse_operations * aop, void * userdata
       if (aop->trim) {
         reply.error = aop->trim(from, len, userdata);
       }
+      pthread_mutex_lock(&srv->tx_lock);
       write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
+      pthread_mutex_unlock(&srv->tx_lock);
       break;
 #endif
     default:
       assert(0);
     }
   }
-  if (bytes_read == -1) {
-    warn("error reading userside of nbd socket");
-    return EXIT_FAILURE;
+  free(buf.data);
+  return NULL;
+}
+
+/* Pass the nbd connection and the backend fds to a successor. */
+static int send_handover(int successor, int sk, int nbd, const struct buse_operations *aop) {
+  int fds[BUSE_MAX_HANDOVER_FDS + 2];
+  char control[CMSG_SPACE(sizeof(fds))];
+  char magic[] = "BUSE";
+  struct iovec iov = { .iov_base = magic, .iov_len = sizeof(magic) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+  };
+  struct cmsghdr *cmsg;
+  int nfds = 0;
+
+  fds[nfds++] = sk;
+  fds[nfds++] = nbd;
+  for (int i = 0; i < aop->handover_nfds && i < BUSE_MAX_HANDOVER_FDS; i++) {
+    fds[nfds++] = aop->handover_fds[i];
   }
-  return EXIT_SUCCESS;
+  memset(control, 0, sizeof(control));
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+  if (sendmsg(successor, &msg, 0) == -1) {
+    warn("failed to hand over nbd connection");
+    return -1;
+  }
+  return 0;
 }
 
-int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
+/* Connection received by buse_takeover(), served by the next buse_main(). */
+static int takeover_sk = -1;
+static int takeover_nbd = -1;
+
+int buse_takeover(const char *handover_path, int *fds, int max_fds) {
+  int received[BUSE_MAX_HANDOVER_FDS + 2];
+  char control[CMSG_SPACE(sizeof(received))];
+  char magic[5];
+  struct iovec iov = { .iov_base = magic, .iov_len = sizeof(magic) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct cmsghdr *cmsg;
+  int ctl, nfds, i;
+
+  ctl = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(ctl != -1);
+  strncpy(addr.sun_path, handover_path, sizeof(addr.sun_path) - 1);
+  if (connect(ctl, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    warn("failed to connect to handover socket `%s'", handover_path);
+    close(ctl);
+    return -1;
+  }
+  if (recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC) <= 0 ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      memcmp(magic, "BUSE", sizeof(magic)) != 0) {
+    warnx("no nbd connection received from `%s'", handover_path);
+    close(ctl);
+    return -1;
+  }
+  close(ctl);
+
+  nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(received, CMSG_DATA(cmsg), nfds * sizeof(int));
+  assert(nfds >= 2);
+  takeover_sk = received[0];
+  takeover_nbd = received[1];
+  for (i = 2; i < nfds; i++) {
+    if (i - 2 < max_fds) {
+      fds[i - 2] = received[i];
+    } else {
+      close(received[i]);
+    }
+  }
+  return nfds - 2 < max_fds ? nfds - 2 : max_fds;
+}
+
+/* Listen for a successor on the handover socket. */
+static int listen_handover(const char *handover_path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int ctl;
+
+  ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert(ctl != -1);
+  strncpy(addr.sun_path, handover_path, sizeof(addr.sun_path) - 1);
+  unlink(handover_path);
+  if (bind(ctl, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(ctl, 1) == -1) {
+    warn("failed to listen on handover socket `%s'", handover_path);
+    close(ctl);
+    return -1;
+  }
+  return ctl;
+}
+
+/* Serve userland side of nbd socket. If everything worked ok, return 0.
+ * handed_over is set if the connection was passed to a successor. */
+static int serve_nbd(int sk, int nbd, const struct buse_operations * aop, void * userdata,
+    int *handed_over) {
+  struct buse_server srv = {
+    .sk = sk,
+    .aop = aop,
+    .userdata = userdata,
+    .rx_lock = PTHREAD_MUTEX_INITIALIZER,
+    .tx_lock = PTHREAD_MUTEX_INITIALIZER,
+    .async_lock = PTHREAD_MUTEX_INITIALIZER,
+    .async_idle = PTHREAD_COND_INITIALIZER,
+    .status = EXIT_SUCCESS,
+    .ctl = -1,
+    .successor = -1,
+  };
+  u_int32_t nthreads = aop->threads > 1 ? aop->threads : 1;
+  pthread_t *workers;
+  u_int32_t i;
+
+  *handed_over = 0;
+  if (aop->handover_path) {
+    srv.ctl = listen_handover(aop->handover_path);
+  }
+
+  /* The calling thread is the first worker. */
+  workers = calloc(nthreads, sizeof(*workers));
+  assert(workers != NULL);
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&workers[i], NULL, serve_worker, &srv) != 0) {
+      warnx("failed to start worker thread %u", i);
+      nthreads = i;
+      break;
+    }
+  }
+  serve_worker(&srv);
+  for (i = 1; i < nthreads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  pthread_mutex_lock(&srv.async_lock);
+  while (srv.inflight > 0) {
+    pthread_cond_wait(&srv.async_idle, &srv.async_lock);
+  }
+  pthread_mutex_unlock(&srv.async_lock);
+
+  if (srv.ctl != -1) {
+    close(srv.ctl);
+  }
+  /* All requests read so far have been answered, the rest is left in the
+   * socket for the successor. */
+  if (srv.successor != -1) {
+    if (send_handover(srv.successor, sk, nbd, aop) == 0) {
+      *handed_over = 1;
+    } else {
+      srv.status = EXIT_FAILURE;
+    }
+    close(srv.successor);
+    return srv.status;
+  }
+  if (aop->handover_path) {
+    unlink(aop->handover_path);
+  }
+
+  /* Handle a disconnect request. */
+  if (srv.disconnected && aop->disc) {
+    aop->disc(userdata);
+  }
+  return srv.status;
+}
+
+/* Open the nbd device and fork a child that connects it to a socket pair
+ * and stays in NBD_DO_IT. The server side of the pair is stored in sk. */
+static int start_nbd(const char* dev_file, const struct buse_operations *aop,
+    int *server_sk, int *nbd_fd, pid_t *child)
 {
   int sp[2];
   int nbd, sk, err, flags;
+  pid_t pid;
 
   err = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
   assert(!err);
@@ -237,7 +627,7 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   err = ioctl(nbd, NBD_CLEAR_SOCK);
   assert(err != -1);
 
-  pid_t pid = fork();
+  pid = fork();
   if (pid == 0) {
     /* Block all signals to not get interrupted in ioctl(NBD_DO_IT), as
      * it seems there is no good way to handle such interruption.*/
@@ -266,6 +656,17 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
 #endif
 #if defined NBD_FLAG_SEND_FLUSH
       flags |= NBD_FLAG_SEND_FLUSH;
+#endif
+#if defined NBD_FLAG_SEND_FUA && defined NBD_CMD_FLAG_FUA
+      /* FUA writes are followed by a flush, see serve_worker(). */
+      if (aop->flush && !aop->submit) {
+        flags |= NBD_FLAG_SEND_FUA;
+      }
+#endif
+#if defined NBD_FLAG_READ_ONLY
+      if (!aop->write && !aop->submit) {
+        flags |= NBD_FLAG_READ_ONLY;
+      }
 #endif
       if (flags != 0 && ioctl(nbd, NBD_SET_FLAGS, flags) == -1){
         fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, %d) failed.[%s]\n", flags, strerror(errno));
@@ -290,10 +691,32 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
 
     exit(0);
   }
+  close(sp[1]);
+
+  *server_sk = sp[0];
+  *nbd_fd = nbd;
+  *child = pid;
+  return 0;
+}
+
+int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
+{
+  int sk, nbd, err;
+  pid_t pid = -1;
+
+  if (takeover_sk != -1) {
+    /* Serve the connection of our predecessor, whose child stays in
+     * NBD_DO_IT for the device. */
+    sk = takeover_sk;
+    nbd = takeover_nbd;
+    takeover_sk = takeover_nbd = -1;
+  } else if ((err = start_nbd(dev_file, aop, &sk, &nbd, &pid)) != 0) {
+    return err;
+  }
 
   /* Parent handles termination signals by terminating nbd device. */
-  assert(nbd_dev_to_disconnect == -1);
-  nbd_dev_to_disconnect = nbd;
+  int slot = add_nbd_to_disconnect(nbd);
+  assert(slot != -1);
   struct sigaction act;
   act.sa_handler = disconnect_nbd;
   act.sa_flags = SA_RESTART;
@@ -313,14 +736,19 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
     return EXIT_FAILURE;
   }
 
-  close(sp[1]);
-
   /* serve NBD socket */
-  int status;
-  status = serve_nbd(sp[0], aop, userdata);
-  if (close(sp[0]) != 0) warn("problem closing server side nbd socket");
+  int status, handed_over;
+  status = serve_nbd(sk, nbd, aop, userdata, &handed_over);
+  nbd_devs_to_disconnect[slot] = 0;
+  if (close(sk) != 0) warn("problem closing server side nbd socket");
   if (status != 0) return status;
 
+  /* Our child, or our predecessor's, goes on serving the device for the
+   * successor, so there is nothing to wait for. */
+  if (handed_over || pid == -1) {
+    return EXIT_SUCCESS;
+  }
+
   /* wait for subprocess */
   if (waitpid(pid, &status, 0) == -1) {
     warn("waitpid failed");
@@ -0,0 +1,40 @@
+#ifndef FANOUT_H_INCLUDED
+#define FANOUT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+  struct buse_fanout;
+
+  enum { BUSE_FANOUT_READ, BUSE_FANOUT_WRITE, BUSE_FANOUT_TRIM };
+
+  /* One piece of a request, on one member. */
+  struct buse_fanout_io {
+    int member;
+    int op;
+    void *buf;     // unused for trims
+    u_int32_t len;
+    u_int64_t offset;
+    /* private */
+    struct buse_fanout_io *next;  // of the same member
+    struct buse_fanout_io *next_job;
+    struct fanout_batch *batch;
+  };
+
+  // start one I/O thread per member of an array; fds[i] may be -1 for a
+  // missing member, which gets no thread. Returns NULL on failure.
+  struct buse_fanout *buse_fanout_create(const int *fds, int count);
+
+  // do the count pieces, those of different members concurrently and
+  // those of one member in order, merging adjacent ones into one call.
+  // Returns once all are done, with the first error as an errno.
+  int buse_fanout_run(struct buse_fanout *fanout, struct buse_fanout_io *ios, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FANOUT_H_INCLUDED */
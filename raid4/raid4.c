@@ -15,6 +15,7 @@
 
 #include <argp.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -24,9 +25,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "cache.h"
+#include "fanout.h"
+#include "tier.h"
+#include "writeback.h"
 
 #define UNUSED(x) (void)(x) // used to suppress "unused variable" warnings without turning off the feature entirely
 
@@ -41,6 +48,7 @@ int ok_dev = -1; // index of dev_fd that has a valid drive (used in degraded mod
 int rebuild_dev = -1; // index of drive that is being added with '+' for RAID rebuilt
 
 int last_read_dev = 0; // used to interleave reading between the two devices
+struct buse_fanout *fanout; // does the parts of a request on different devices at once
 
 // XOR buf1 and buf2, store result in buf1
 void bigxor(int8_t * buf1, int8_t * buf2) {
@@ -49,25 +57,49 @@ void bigxor(int8_t * buf1, int8_t * buf2) {
     }
 }
 
-// calculate missed block data from XORing all other blocks
+// pread/pwrite all of len bytes; returns 0 or an errno
+static int read_blk(int fd, void *buf, u_int32_t len, u_int64_t offset) {
+    ssize_t done = pread(fd, buf, len, offset);
+    if (done == (ssize_t)len)
+        return 0;
+    return done < 0 ? errno : EIO;
+}
+
+static int write_blk(int fd, const void *buf, u_int32_t len, u_int64_t offset) {
+    ssize_t done = pwrite(fd, buf, len, offset);
+    if (done == (ssize_t)len)
+        return 0;
+    return done < 0 ? errno : EIO;
+}
+
+// calculate missed block data from XORing all other blocks; returns NULL
+// with errno set if they can't be read
 void * getMissedBlk(u_int32_t on_device_blk_idx) {
     void * buf1 = malloc(block_size);
     void * buf2 = malloc(block_size);
     int buf1_inited = 0;
+    int ret = 0;
 
-    for(int i = 0; i < num_devices; ++i) {
+    if (buf1 == NULL || buf2 == NULL)
+        ret = ENOMEM;
+    for(int i = 0; ret == 0 && i < num_devices; ++i) {
         if(dev_fd[i] != -1) {
             if(buf1_inited == 0) {
-                pread(dev_fd[i], buf1, block_size, on_device_blk_idx * block_size);
+                ret = read_blk(dev_fd[i], buf1, block_size, (u_int64_t)on_device_blk_idx * block_size);
                 buf1_inited = 1;
             } else {
-                pread(dev_fd[i], buf2, block_size, on_device_blk_idx * block_size);
+                ret = read_blk(dev_fd[i], buf2, block_size, (u_int64_t)on_device_blk_idx * block_size);
                 bigxor(buf1, buf2);
             }
         }
     }
 
     free(buf2);
+    if (ret != 0) {
+        free(buf1);
+        errno = ret;
+        return NULL;
+    }
     return buf1;
 }
 
@@ -76,43 +108,53 @@ static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
     if (verbose)
         fprintf(stderr, "R - %lu, %u\n", offset, len);
 
-    u_int32_t blk_num = offset / block_size;
-    u_int32_t device_idx = blk_num % (num_devices - 1);
-    u_int32_t on_device_blk_idx = blk_num / (num_devices - 1);
-    u_int64_t offset_on_blk = offset % block_size;
-    u_int64_t device_offset = on_device_blk_idx * block_size + offset_on_blk;
-    u_int32_t len_tobe_read = len <= block_size - offset_on_blk ? len : block_size - offset_on_blk;
-
-    if(dev_fd[device_idx] != -1) {
-        pread(dev_fd[device_idx], buf, len_tobe_read, device_offset);
-        fprintf(stderr, "pread calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_read, device_offset);
-    } else {
-        void * blk_calced = getMissedBlk(on_device_blk_idx);
-        memcpy(buf, blk_calced, len_tobe_read);
-        free(blk_calced);
-    }
-    len -= len_tobe_read;
-    buf += len_tobe_read;
-    while(len > 0) {
-        blk_num++;
-        device_idx = blk_num % (num_devices - 1);
-        on_device_blk_idx = blk_num / (num_devices - 1);
-        device_offset = on_device_blk_idx * block_size;
-        len_tobe_read = len <= (u_int32_t)block_size ? len : (u_int32_t)block_size;
-
-        if(dev_fd[device_idx] != -1) {
-            pread(dev_fd[device_idx], buf, len_tobe_read, device_offset);
-            fprintf(stderr, "pread calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_read, device_offset);
+    // read the blocks of all present devices at once, then rebuild the
+    // ones of a missing device from the others
+    struct buse_fanout_io *ios = malloc((len / block_size + 2) * sizeof(*ios));
+    if (ios == NULL)
+        return ENOMEM;
+    int count = 0;
+    bool missed = false;
+    for (u_int64_t pos = offset; pos < offset + len; ) {
+        u_int32_t blk_num = pos / block_size;
+        u_int32_t device_idx = blk_num % (num_devices - 1);
+        u_int32_t on_device_blk_idx = blk_num / (num_devices - 1);
+        u_int64_t offset_on_blk = pos % block_size;
+        u_int32_t len_tobe_read = offset + len - pos <= block_size - offset_on_blk ? offset + len - pos : block_size - offset_on_blk;
+
+        if (dev_fd[device_idx] != -1) {
+            struct buse_fanout_io *io = &ios[count++];
+            io->member = device_idx;
+            io->op = BUSE_FANOUT_READ;
+            io->buf = (char *)buf + (pos - offset);
+            io->len = len_tobe_read;
+            io->offset = (u_int64_t)on_device_blk_idx * block_size + offset_on_blk;
         } else {
-            void * blk_calced = getMissedBlk(on_device_blk_idx);
-            memcpy(buf, blk_calced, len_tobe_read);
+            missed = true;
+        }
+        pos += len_tobe_read;
+    }
+    int ret = buse_fanout_run(fanout, ios, count);
+    free(ios);
+
+    for (u_int64_t pos = offset; ret == 0 && missed && pos < offset + len; ) {
+        u_int32_t blk_num = pos / block_size;
+        u_int32_t device_idx = blk_num % (num_devices - 1);
+        u_int64_t offset_on_blk = pos % block_size;
+        u_int32_t len_tobe_read = offset + len - pos <= block_size - offset_on_blk ? offset + len - pos : block_size - offset_on_blk;
+
+        if (dev_fd[device_idx] == -1) {
+            void * blk_calced = getMissedBlk(blk_num / (num_devices - 1));
+            if (blk_calced == NULL) {
+                ret = errno;
+                break;
+            }
+            memcpy((char *)buf + (pos - offset), (char *)blk_calced + offset_on_blk, len_tobe_read);
             free(blk_calced);
         }
-        len -= len_tobe_read;
-        buf += len_tobe_read;
+        pos += len_tobe_read;
     }
-
-    return 0;
+    return ret;
 }
 
 void get_new_parity_blk(int8_t * new_blk, int8_t * old_blk, int8_t * parity_blk) {
@@ -122,42 +164,101 @@ void get_new_parity_blk(int8_t * new_blk, int8_t * old_blk, int8_t * parity_blk)
     }
 }
 
-void write_into_blk(const void *buf, int device_idx, u_int32_t len_tobe_write, u_int64_t device_offset, u_int32_t on_device_blk_idx) {
+// read-modify-write of a block and its parity; returns 0 or an errno
+int write_into_blk(const void *buf, int device_idx, u_int32_t len_tobe_write, u_int64_t device_offset, u_int32_t on_device_blk_idx) {
+    u_int64_t blk_offset = (u_int64_t)on_device_blk_idx * block_size;
     void * old_blk = malloc(block_size);
     void * parity_blk = malloc(block_size);
-    pread(dev_fd[device_idx], old_blk, block_size, on_device_blk_idx * block_size);
-    pread(dev_fd[num_devices-1], parity_blk, block_size, on_device_blk_idx * block_size);
-
-    pwrite(dev_fd[device_idx], buf, len_tobe_write, device_offset);
-    fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_write, device_offset);
     void * new_blk = malloc(block_size);
-    pread(dev_fd[device_idx], new_blk, block_size, on_device_blk_idx * block_size);
-    get_new_parity_blk(new_blk, old_blk, parity_blk);
-
-    pwrite(dev_fd[num_devices-1], parity_blk, block_size, on_device_blk_idx * block_size);
-    fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %d\n", num_devices-1, block_size, 0);
+    int ret = 0;
+
+    if (old_blk == NULL || parity_blk == NULL || new_blk == NULL)
+        ret = ENOMEM;
+    if (ret == 0)
+        ret = read_blk(dev_fd[device_idx], old_blk, block_size, blk_offset);
+    if (ret == 0)
+        ret = read_blk(dev_fd[num_devices-1], parity_blk, block_size, blk_offset);
+    if (ret == 0)
+        ret = write_blk(dev_fd[device_idx], buf, len_tobe_write, device_offset);
+    if (verbose)
+        fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_write, device_offset);
+    if (ret == 0)
+        ret = read_blk(dev_fd[device_idx], new_blk, block_size, blk_offset);
+    if (ret == 0) {
+        get_new_parity_blk(new_blk, old_blk, parity_blk);
+        ret = write_blk(dev_fd[num_devices-1], parity_blk, block_size, blk_offset);
+        if (verbose)
+            fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %lu\n", num_devices-1, block_size, blk_offset);
+    }
 
     free(old_blk);
     free(parity_blk);
     free(new_blk);
+    return ret;
 }
 
 // the drive we are writing is missing, so only need to update parity block
-void write_on_missed(const void *buf, u_int32_t on_device_blk_idx, u_int64_t offset_on_blk, u_int32_t len_tobe_write) {
+int write_on_missed(const void *buf, u_int32_t on_device_blk_idx, u_int64_t offset_on_blk, u_int32_t len_tobe_write) {
+    u_int64_t blk_offset = (u_int64_t)on_device_blk_idx * block_size;
     void * old_blk = getMissedBlk(on_device_blk_idx);
+    if (old_blk == NULL)
+        return errno;
     void * new_blk = malloc(block_size);
-    memcpy(new_blk, old_blk, block_size);
-    memcpy(new_blk + offset_on_blk, buf, len_tobe_write);
     void * parity_blk = malloc(block_size);
-    pread(dev_fd[num_devices-1], parity_blk, block_size, on_device_blk_idx * block_size);
-
-    get_new_parity_blk(new_blk, old_blk, parity_blk);
-    pwrite(dev_fd[num_devices-1], parity_blk, block_size, on_device_blk_idx * block_size);
-    fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %u\n", num_devices-1, block_size, on_device_blk_idx * block_size);
+    int ret = 0;
+
+    if (new_blk == NULL || parity_blk == NULL)
+        ret = ENOMEM;
+    if (ret == 0) {
+        memcpy(new_blk, old_blk, block_size);
+        memcpy((char *)new_blk + offset_on_blk, buf, len_tobe_write);
+        ret = read_blk(dev_fd[num_devices-1], parity_blk, block_size, blk_offset);
+    }
+    if (ret == 0) {
+        get_new_parity_blk(new_blk, old_blk, parity_blk);
+        ret = write_blk(dev_fd[num_devices-1], parity_blk, block_size, blk_offset);
+        if (verbose)
+            fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %lu\n", num_devices-1, block_size, blk_offset);
+    }
 
     free(old_blk);
     free(new_blk);
     free(parity_blk);
+    return ret;
+}
+
+// write whole stripes: the parity comes from the new data alone, and all
+// devices are written at once
+int write_full_stripes(const void *buf, u_int32_t rows, u_int64_t first_row) {
+    u_int64_t row_bytes = (u_int64_t)block_size * (num_devices - 1);
+    int8_t *parity = malloc((u_int64_t)rows * block_size);
+    struct buse_fanout_io *ios = malloc((u_int64_t)rows * num_devices * sizeof(*ios));
+    int count = 0;
+
+    if (parity == NULL || ios == NULL) {
+        free(parity);
+        free(ios);
+        return ENOMEM;
+    }
+    for (u_int32_t r = 0; r < rows; ++r) {
+        int8_t *row = (int8_t *)buf + r * row_bytes;
+        int8_t *row_parity = parity + (u_int64_t)r * block_size;
+        memcpy(row_parity, row, block_size);
+        for (int i = 0; i < num_devices; ++i) {
+            struct buse_fanout_io *io = &ios[count++];
+            if (i > 0 && i < num_devices - 1)
+                bigxor(row_parity, row + (u_int64_t)i * block_size);
+            io->member = i;
+            io->op = BUSE_FANOUT_WRITE;
+            io->buf = i < num_devices - 1 ? row + (u_int64_t)i * block_size : row_parity;
+            io->len = block_size;
+            io->offset = (first_row + r) * block_size;
+        }
+    }
+    int ret = buse_fanout_run(fanout, ios, count);
+    free(parity);
+    free(ios);
+    return ret;
 }
 
 static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
@@ -171,71 +272,83 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
     u_int64_t offset_on_blk = offset % block_size;
     u_int64_t device_offset = on_device_blk_idx * block_size + offset_on_blk;
     u_int32_t len_tobe_write = len <= block_size - offset_on_blk ? len : block_size - offset_on_blk;
+    int ret = 0;
 
     if(degraded) {
         // 1) the drive we are writing is missing, so only need to update parity block
         // 2) the drive we are writing is not missing, some other data drive missed.  so this is same as "else"
         // 3) the drive we are writing is not missing, parity drive missed, so directly write on it.
         if(dev_fd[device_idx] == -1) {
-            write_on_missed(buf, on_device_blk_idx, offset_on_blk, len_tobe_write);
+            ret = write_on_missed(buf, on_device_blk_idx, offset_on_blk, len_tobe_write);
         } else if(dev_fd[num_devices-1] == -1) {
-            pwrite(dev_fd[device_idx], buf, len_tobe_write, device_offset);
-            fprintf(stderr, "pread calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_write, device_offset);
+            ret = write_blk(dev_fd[device_idx], buf, len_tobe_write, device_offset);
+            if (verbose)
+                fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_write, device_offset);
         } else {
-            write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
+            ret = write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
         }
         len -= len_tobe_write;
-        buf += len_tobe_write;
-        while(len > 0) {
+        buf = (const char *)buf + len_tobe_write;
+        while(ret == 0 && len > 0) {
             blk_num++;
             device_idx = blk_num % (num_devices - 1);
             on_device_blk_idx = blk_num / (num_devices - 1);
-            device_offset = on_device_blk_idx * block_size;
+            device_offset = (u_int64_t)on_device_blk_idx * block_size;
             len_tobe_write = len <= (u_int32_t)block_size ? len : (u_int32_t)block_size;
 
             if(dev_fd[device_idx] == -1) {
-                write_on_missed(buf, on_device_blk_idx, 0, len_tobe_write);
+                ret = write_on_missed(buf, on_device_blk_idx, 0, len_tobe_write);
             } else if(dev_fd[num_devices-1] == -1) {
-                pwrite(dev_fd[device_idx], buf, len_tobe_write, device_offset);
-                fprintf(stderr, "pread calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_write, device_offset);
+                ret = write_blk(dev_fd[device_idx], buf, len_tobe_write, device_offset);
+                if (verbose)
+                    fprintf(stderr, "pwrite calles, drive_num: %d, len: %u, offset: %lu\n", device_idx, len_tobe_write, device_offset);
             } else {
-                write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
+                ret = write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
             }
             len -= len_tobe_write;
-            buf += len_tobe_write;
+            buf = (const char *)buf + len_tobe_write;
         }
 
     } else {
-        write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
-        len -= len_tobe_write;
-        buf += len_tobe_write;
-        while(len > 0) {
-            blk_num++;
-            device_idx = blk_num % (num_devices - 1);
-            on_device_blk_idx = blk_num / (num_devices - 1);
-            device_offset = on_device_blk_idx * block_size;
-            len_tobe_write = len <= (u_int32_t)block_size ? len : (u_int32_t)block_size;
-
-            write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
-            
+        u_int64_t row_bytes = (u_int64_t)block_size * (num_devices - 1);
+        while(ret == 0 && len > 0) {
+            if (offset % row_bytes == 0 && len >= row_bytes) {
+                u_int32_t rows = len / row_bytes;
+                ret = write_full_stripes(buf, rows, offset / row_bytes);
+                len_tobe_write = rows * row_bytes;
+            } else {
+                blk_num = offset / block_size;
+                device_idx = blk_num % (num_devices - 1);
+                on_device_blk_idx = blk_num / (num_devices - 1);
+                offset_on_blk = offset % block_size;
+                device_offset = (u_int64_t)on_device_blk_idx * block_size + offset_on_blk;
+                len_tobe_write = len <= block_size - offset_on_blk ? len : block_size - offset_on_blk;
+
+                ret = write_into_blk(buf, device_idx, len_tobe_write, device_offset, on_device_blk_idx);
+            }
+            offset += len_tobe_write;
             len -= len_tobe_write;
-            buf += len_tobe_write;
+            buf = (const char *)buf + len_tobe_write;
         }
     }
 
-    return 0;
+    return ret;
 }
 
 static int xmp_flush(void *userdata) {
+    int ret = 0;
     UNUSED(userdata);
     if (verbose)
         fprintf(stderr, "Received a flush request.\n");
     for (int i=0; i<num_devices; i++) {
         if (dev_fd[i] != -1) { // handle degraded mode
-            fsync(dev_fd[i]); // we use fsync to flush OS buffers to underlying devices
+            // we use fsync to flush OS buffers to underlying devices; every
+            // device is flushed, the first error is returned
+            if (fsync(dev_fd[i]) == -1 && ret == 0)
+                ret = errno;
         }
     }
-    return 0;
+    return ret;
 }
 
 static void xmp_disc(void *userdata) {
@@ -260,6 +373,13 @@ static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata) {
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output", 0},
+    {"handover", 'H', "SOCKET", 0, "Hand the RAID over to a new process connecting to SOCKET", 0},
+    {"takeover", 'T', "SOCKET", 0, "Take the RAID over from the process listening on SOCKET", 0},
+    {"cache", 'c', "SIZE", 0, "Cache up to SIZE bytes of reads (suffixes K, M, G), SIGUSR1 prints statistics", 0},
+    {"readahead", 'r', "SIZE", 0, "Read sequential streams up to SIZE bytes ahead into the cache, which is 16 times SIZE unless given", 0},
+    {"writeback", 'w', "SIZE", 0, "Buffer up to SIZE bytes of writes in memory and write them back in the background", 0},
+    {"ssd", 's', "FILE", 0, "Keep the most used blocks on the fast device or file FILE", 0},
+    {"ssd-writeback", 'W', 0, 0, "Write to blocks on the fast device only, and write them back later", 0},
     {0},
 };
 
@@ -268,8 +388,28 @@ struct arguments {
     char* device[16];
     char* raid_device;
     int verbose;
+    char* handover;
+    char* takeover;
+    unsigned long long cache;
+    unsigned long long readahead;
+    unsigned long long writeback;
+    char* ssd;
+    int ssd_writeback;
 };
 
+/* A size in bytes with an optional K, M or G suffix, 0 if it isn't one. */
+static unsigned long long parse_size(const char *arg) {
+    char *endptr;
+    unsigned long long size = strtoull(arg, &endptr, 10);
+
+    switch (*endptr) {
+        case 'G': size <<= 10; /* fall through */
+        case 'M': size <<= 10; /* fall through */
+        case 'K': size <<= 10; endptr++; break;
+    }
+    return *endptr == '\0' ? size : 0;
+}
+
 /* Parse a single option. */
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
@@ -281,6 +421,43 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->verbose = 1;
             break;
 
+        case 'H':
+            arguments->handover = arg;
+            break;
+
+        case 'T':
+            arguments->takeover = arg;
+            break;
+
+        case 'c':
+            arguments->cache = parse_size(arg);
+            if (arguments->cache == 0) {
+                errx(EXIT_FAILURE, "cache SIZE must be a positive integer");
+            }
+            break;
+
+        case 'r':
+            arguments->readahead = parse_size(arg);
+            if (arguments->readahead == 0) {
+                errx(EXIT_FAILURE, "readahead SIZE must be a positive integer");
+            }
+            break;
+
+        case 's':
+            arguments->ssd = arg;
+            break;
+
+        case 'W':
+            arguments->ssd_writeback = 1;
+            break;
+
+        case 'w':
+            arguments->writeback = parse_size(arg);
+            if (arguments->writeback == 0) {
+                errx(EXIT_FAILURE, "writeback SIZE must be a positive integer");
+            }
+            break;
+
         case ARGP_KEY_ARG:
             switch (state->arg_num) {
 
@@ -333,8 +510,36 @@ static struct argp argp = {
            "\n\n"
            "If you prepend '+' to a DEVICE, you are re-adding it as a replacement to the RAID, and we will rebuild the array. "
            "This is synchronous; the rebuild will have to finish before the RAID is started. "
+           "\n\n"
+           "To upgrade a running RAID without tearing down RAIDDEVICE, start it with --handover and start the new "
+           "binary with --takeover on the same SOCKET and the same arguments; it gets the open devices from the old one. "
 };
 
+static struct buse_cache *cache;
+static struct buse_writeback *writeback;
+static struct buse_tier *tier;
+
+static void print_stats(void) {
+    if (tier)
+        buse_tier_print_stats(tier, stderr);
+    if (cache)
+        buse_cache_print_stats(cache, stderr);
+    if (writeback)
+        buse_writeback_print_stats(writeback, stderr);
+}
+
+// print the cache statistics whenever SIGUSR1 arrives
+static void *stats_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig) == 0)
+            print_stats();
+    }
+    return NULL;
+}
+
 static int do_raid_rebuild() {
     uint32_t blk_count = raid_device_size / block_size;
     for(u_int32_t i = 0; i < blk_count; ++i) {
@@ -366,6 +571,18 @@ int main(int argc, char *argv[]) {
     raid_device_size=0; // will be detected from the drives available
     ok_dev=-1;
     bool rebuild_needed = false; // will be set to true if a drive is MISSING
+
+    // on takeover the devices are already open in the old process, which passes them in order, minus MISSING ones
+    int taken_fd[16];
+    int num_taken = 0, next_taken = 0;
+    if (arguments.takeover) {
+        num_taken = buse_takeover(arguments.takeover, taken_fd, 16);
+        if (num_taken < 0) {
+            fprintf(stderr, "ERROR: Could not take over from '%s'.\n", arguments.takeover);
+            exit(1);
+        }
+    }
+
     for (int i=0; i<num_devices; i++) {
         char* dev_path = arguments.device[i];
         if (strcmp(dev_path,"MISSING")==0) {
@@ -384,7 +601,15 @@ int main(int argc, char *argv[]) {
                 rebuild_needed = true;
             }
             ok_dev = i;
-            dev_fd[i] = open(dev_path,O_RDWR);
+            if (arguments.takeover) {
+                if (next_taken == num_taken) {
+                    fprintf(stderr, "ERROR: Old process passed %d devices, fewer than given.\n", num_taken);
+                    exit(1);
+                }
+                dev_fd[i] = taken_fd[next_taken++];
+            } else {
+                dev_fd[i] = open(dev_path,O_RDWR);
+            }
             if (dev_fd[i] < 0) {
                 perror(dev_path);
                 exit(1);
@@ -399,6 +624,10 @@ int main(int argc, char *argv[]) {
     
     raid_device_size = raid_device_size/block_size*block_size; // divide+mult to truncate to block size
     bop.size = raid_device_size; // tell BUSE how big our block device is
+    if (rebuild_needed && arguments.takeover) {
+        fprintf(stderr, "ERROR: Can't rebuild while taking over a running RAID.\n");
+        exit(1);
+    }
     if (rebuild_needed) {
         if (degraded) {
             fprintf(stderr, "ERROR: Can't rebuild from a missing device (i.e., you can't combine MISSING and '+').\n");
@@ -416,6 +645,99 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     fprintf(stderr, "RAID device resulting size: %ld.\n", bop.size);
-    
+
+    fanout = buse_fanout_create(dev_fd, num_devices);
+    if (fanout == NULL) {
+        fprintf(stderr, "ERROR: Could not start the device threads.\n");
+        exit(1);
+    }
+
+    int handover_fd[16];
+    if (arguments.handover) {
+        for (int i=0; i<num_devices; i++) {
+            if (dev_fd[i] != -1) {
+                handover_fd[bop.handover_nfds++] = dev_fd[i];
+            }
+        }
+        bop.handover_path = arguments.handover;
+        bop.handover_fds = handover_fd;
+    }
+
+    if (arguments.ssd && (arguments.handover || arguments.takeover)) {
+        fprintf(stderr, "ERROR: The fast device can't be handed over.\n");
+        exit(1);
+    }
+    // the old process would still be writing back its buffer while the
+    // successor serves the same rows
+    if (arguments.writeback && (arguments.handover || arguments.takeover)) {
+        fprintf(stderr, "ERROR: The write-back buffer can't be handed over.\n");
+        exit(1);
+    }
+    if (arguments.readahead && !arguments.cache)
+        arguments.cache = arguments.readahead * 16;
+    if (arguments.cache || arguments.writeback || arguments.ssd) {
+        static sigset_t sigs;
+        const struct buse_operations *ops = &bop;
+        void *userdata = NULL;
+        pthread_t tid;
+
+        // block SIGUSR1 before the layers start their threads, so only the
+        // statistics thread takes it
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+        // the read cache goes on top and writes through to the write-back
+        // buffer, which writes back to the fast device in front of the array
+        if (arguments.ssd) {
+            tier = buse_tier_create(ops, userdata, arguments.ssd, arguments.ssd_writeback);
+            if (tier == NULL) {
+                fprintf(stderr, "ERROR: Could not set up the fast device '%s': %s.\n", arguments.ssd, strerror(errno));
+                exit(1);
+            }
+            ops = buse_tier_operations(tier);
+            userdata = tier;
+        }
+        if (arguments.writeback) {
+            writeback = buse_writeback_create(ops, userdata, arguments.writeback);
+            if (writeback == NULL) {
+                fprintf(stderr, "ERROR: Could not set up the write-back buffer.\n");
+                exit(1);
+            }
+            ops = buse_writeback_operations(writeback);
+            userdata = writeback;
+        }
+        if (arguments.cache) {
+            cache = buse_cache_create(ops, userdata, arguments.cache);
+            if (cache == NULL) {
+                fprintf(stderr, "ERROR: Could not allocate the cache.\n");
+                exit(1);
+            }
+            ops = buse_cache_operations(cache);
+            userdata = cache;
+            // read ahead whole stripes, so every member is read from
+            if (arguments.readahead &&
+                buse_cache_set_readahead(cache, arguments.readahead, (u_int64_t)block_size * (num_devices - 1)) != 0) {
+                fprintf(stderr, "ERROR: Could not start reading ahead.\n");
+                exit(1);
+            }
+        }
+        if (pthread_create(&tid, NULL, stats_thread, &sigs) != 0) {
+            fprintf(stderr, "ERROR: Could not start the statistics thread.\n");
+            exit(1);
+        }
+        int ret = buse_main(arguments.raid_device, ops, userdata);
+        if (writeback && buse_writeback_close(writeback) != 0) {
+            fprintf(stderr, "ERROR: Writing back buffered data failed.\n");
+            ret = 1;
+        }
+        if (tier && buse_tier_close(tier) != 0) {
+            fprintf(stderr, "ERROR: Could not save the state of the fast device.\n");
+            ret = 1;
+        }
+        print_stats();
+        return ret;
+    }
+
     return buse_main(arguments.raid_device, &bop, NULL);
 }
@@ -0,0 +1,1101 @@
+/*
+ * tier - cache on a fast device for BUSE backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The fast device starts with a header, followed by a metadata entry per
+ * slot naming the block of the backend the slot holds and whether it is
+ * dirty, followed by the slots. The metadata lives in memory and commit()
+ * writes the pages of it that changed, after syncing the slots they name.
+ *
+ * A block is promoted on its TIER_PROMOTE-th access within a while, as
+ * counted by a table of decaying counters, unless the access is part of a
+ * long sequential stream: those are read once and would only push the hot
+ * blocks out. Eviction is CLOCK over the clean slots.
+ *
+ * A slot freed by eviction or trim may still be named on disk, so it waits
+ * on the limbo list for the next commit before it is reused. A background
+ * thread commits whenever something is in limbo, and writes dirty blocks
+ * back when a quarter of the slots are dirty, when a promotion found
+ * nothing clean to evict, and when there were no requests for a tick.
+ *
+ * After a crash, slots may not hold what the metadata says if writes to
+ * them weren't flushed. In write-through mode the backend has everything,
+ * so only dirty slots left by an earlier write-back run are kept; after a
+ * write-back run all the slots are taken as dirty, so the fast device wins.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tier.h"
+
+#define TIER_MAGIC "BUSETIR1"
+#define TIER_VERSION 1
+#define TIER_BLOCK_SHIFT 16
+#define TIER_BLOCK_MASK (BUSE_TIER_BLOCK_SIZE - 1)
+#define TIER_HEADER_SIZE 4096
+#define TIER_META_PAGE 4096
+#define TIER_PAGE_ENTRIES (TIER_META_PAGE / sizeof(struct tier_meta))
+#define TIER_FREE ((u_int64_t)-1)
+#define TIER_DIRTY 1
+#define TIER_PROMOTE 3           /* accesses before a block is promoted */
+#define TIER_HEAT_BITS 16
+#define TIER_STREAMS 8
+#define TIER_SEQ_BYTES (1 << 20) /* streams longer than this bypass the tier */
+#define TIER_EVICT_BATCH 32
+#define TIER_CLEAN_BATCH 16
+#define TIER_SCAN 65536          /* slots looked at per eviction or cleaning */
+#define TIER_TICK_NS 200000000LL
+
+struct tier_header {
+  char magic[8];
+  u_int32_t version;
+  u_int32_t block_shift;
+  u_int64_t nslots;
+  u_int64_t origin_size;
+  u_int32_t clean;      /* shut down properly */
+  u_int32_t writeback;  /* mode of the last run */
+};
+
+struct tier_meta {
+  u_int64_t block;
+  u_int32_t flags;
+  u_int32_t reserved;
+};
+
+enum { SLOT_READY, SLOT_FILLING, SLOT_CLEANING };
+
+struct tier_slot {
+  u_int64_t block;         /* TIER_FREE on the free or limbo list */
+  struct tier_slot *next;  /* hash chain, or free or limbo list */
+  u_int32_t refs;          /* requests using its data */
+  u_int8_t state;
+  u_int8_t dirty;
+  u_int8_t drop;           /* unmap it when the last reference goes */
+  u_int8_t hits;           /* CLOCK reference count */
+};
+
+struct tier_stream {
+  u_int64_t end;
+  u_int64_t run;
+};
+
+struct buse_tier {
+  struct buse_operations ops;
+  struct buse_operations backend;
+  void *userdata;
+  int serialize;                /* the backend handles one call at a time */
+  pthread_mutex_t backend_lock;
+
+  int fd;
+  int writeback;
+  u_int64_t nslots;
+  u_int64_t nblocks;            /* whole blocks of the backend */
+  u_int64_t meta_pages;
+  u_int64_t data_offset;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;         /* a slot finished filling or cleaning */
+  struct tier_slot *slots;
+  struct tier_slot **buckets;
+  u_int64_t mask;
+  struct tier_slot *free;
+  struct tier_slot *limbo;
+  u_int64_t hand, clean_hand;
+  u_int64_t *meta_dirty;        /* pages to write at the next commit */
+  u_int8_t heat[1 << TIER_HEAT_BITS];
+  u_int64_t heat_ticks;
+  struct tier_stream streams[TIER_STREAMS];
+  u_int32_t next_stream;
+  int cleaned;                  /* the backend needs a flush before a commit */
+  int starved;                  /* a promotion found nothing to evict */
+  u_int64_t requests;
+  struct buse_tier_stats stats;
+
+  pthread_mutex_t commit_lock;
+  pthread_cond_t work;          /* wakes the background thread */
+  pthread_t thread;
+  int stop;
+  int running;
+};
+
+static int file_read(int fd, void *buf, size_t len, u_int64_t offset) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread(fd, buf, len, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return errno;
+    }
+    if (n == 0) {
+      memset(buf, 0, len);
+      break;
+    }
+    buf = (char *)buf + n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int file_write(int fd, const void *buf, size_t len, u_int64_t offset) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite(fd, buf, len, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return errno;
+    }
+    buf = (const char *)buf + n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static void backend_enter(struct buse_tier *tier) {
+  if (tier->serialize) {
+    pthread_mutex_lock(&tier->backend_lock);
+  }
+}
+
+static void backend_leave(struct buse_tier *tier) {
+  if (tier->serialize) {
+    pthread_mutex_unlock(&tier->backend_lock);
+  }
+}
+
+static int origin_read(struct buse_tier *tier, void *buf, u_int32_t len, u_int64_t offset) {
+  int ret;
+
+  backend_enter(tier);
+  ret = tier->backend.read(buf, len, offset, tier->userdata);
+  backend_leave(tier);
+  return ret;
+}
+
+static int origin_write(struct buse_tier *tier, const void *buf, u_int32_t len, u_int64_t offset) {
+  int ret;
+
+  backend_enter(tier);
+  ret = tier->backend.write(buf, len, offset, tier->userdata);
+  backend_leave(tier);
+  return ret;
+}
+
+static int origin_flush(struct buse_tier *tier) {
+  int ret = 0;
+
+  if (tier->backend.flush) {
+    backend_enter(tier);
+    ret = tier->backend.flush(tier->userdata);
+    backend_leave(tier);
+  }
+  return ret;
+}
+
+static u_int64_t slot_offset(struct buse_tier *tier, struct tier_slot *s) {
+  return tier->data_offset + ((u_int64_t)(s - tier->slots) << TIER_BLOCK_SHIFT);
+}
+
+static struct tier_slot **bucket_of(struct buse_tier *tier, u_int64_t block) {
+  return &tier->buckets[(block ^ (block >> 17)) & tier->mask];
+}
+
+static struct tier_slot *lookup(struct buse_tier *tier, u_int64_t block) {
+  struct tier_slot *s;
+
+  for (s = *bucket_of(tier, block); s != NULL; s = s->next) {
+    if (s->block == block) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static void meta_touch(struct buse_tier *tier, struct tier_slot *s) {
+  u_int64_t page = (s - tier->slots) / TIER_PAGE_ENTRIES;
+
+  tier->meta_dirty[page / 64] |= 1ULL << (page % 64);
+}
+
+static void set_dirty(struct buse_tier *tier, struct tier_slot *s, int dirty) {
+  if (s->dirty != dirty) {
+    s->dirty = dirty;
+    tier->stats.dirty += dirty ? 1 : -1;
+    meta_touch(tier, s);
+  }
+}
+
+static void map(struct buse_tier *tier, struct tier_slot *s, u_int64_t block) {
+  struct tier_slot **b = bucket_of(tier, block);
+
+  s->block = block;
+  s->next = *b;
+  *b = s;
+  s->hits = 0;
+  s->refs = 0;
+  s->drop = 0;
+  s->state = SLOT_READY;
+  tier->stats.cached++;
+  meta_touch(tier, s);
+}
+
+/* Forget what s holds. It goes to limbo, as its entry on disk may still
+ * name the block, unless it never was written. */
+static void unmap(struct buse_tier *tier, struct tier_slot *s, int to_limbo) {
+  struct tier_slot **p;
+
+  for (p = bucket_of(tier, s->block); *p != s; p = &(*p)->next)
+    ;
+  *p = s->next;
+  set_dirty(tier, s, 0);
+  s->block = TIER_FREE;
+  tier->stats.cached--;
+  meta_touch(tier, s);
+  if (to_limbo) {
+    s->next = tier->limbo;
+    tier->limbo = s;
+  } else {
+    s->next = tier->free;
+    tier->free = s;
+  }
+}
+
+/* Forget what s holds once nobody uses it anymore: a request that still
+ * does may be about to write it or mark it dirty. */
+static void discard(struct buse_tier *tier, struct tier_slot *s) {
+  if (s->refs == 0) {
+    unmap(tier, s, 1);
+  } else {
+    s->drop = 1;
+  }
+}
+
+/* Drop a reference, with the lock held. */
+static void release(struct buse_tier *tier, struct tier_slot *s) {
+  if (--s->refs == 0 && s->drop) {
+    unmap(tier, s, 1);
+  }
+}
+
+/* Whether a request continues one of the recent sequential streams, which
+ * is long enough to bypass the tier. */
+static int sequential(struct buse_tier *tier, u_int64_t offset, u_int32_t len) {
+  struct tier_stream *st;
+
+  for (int i = 0; i < TIER_STREAMS; i++) {
+    st = &tier->streams[i];
+    if (st->end == offset) {
+      st->end += len;
+      st->run += len;
+      return st->run > TIER_SEQ_BYTES;
+    }
+  }
+  st = &tier->streams[tier->next_stream++ % TIER_STREAMS];
+  st->end = offset + len;
+  st->run = len;
+  return 0;
+}
+
+/* Move clean slots nobody uses to limbo, as the clock hand finds them. */
+static int evict(struct buse_tier *tier) {
+  struct tier_slot *s;
+  int n = 0;
+
+  for (u_int64_t i = 0; i < 2 * tier->nslots && i < TIER_SCAN && n < TIER_EVICT_BATCH; i++) {
+    s = &tier->slots[tier->hand];
+    tier->hand = (tier->hand + 1) % tier->nslots;
+    if (s->block == TIER_FREE || s->state != SLOT_READY || s->refs > 0 || s->dirty) {
+      continue;
+    }
+    if (s->hits > 0) {
+      s->hits--;
+      continue;
+    }
+    unmap(tier, s, 1);
+    tier->stats.evictions++;
+    n++;
+  }
+  return n;
+}
+
+/* The slot holding block, with a reference taken, once it isn't being
+ * filled or cleaned. If the block isn't cached and promote is set, it may
+ * get a new slot, returned in the filling state for the caller to fill(). */
+static struct tier_slot *acquire(struct buse_tier *tier, u_int64_t block, int promote) {
+  struct tier_slot *s;
+  u_int8_t *heat;
+
+  if (block >= tier->nblocks) {
+    return NULL;
+  }
+  while ((s = lookup(tier, block)) != NULL && s->state != SLOT_READY) {
+    pthread_cond_wait(&tier->ready, &tier->lock);
+  }
+  if (s) {
+    s->refs++;
+    if (s->hits < 3) {
+      s->hits++;
+    }
+    return s;
+  }
+  if (!promote) {
+    return NULL;
+  }
+
+  heat = &tier->heat[(block * 0x9e3779b97f4a7c15ULL) >> (64 - TIER_HEAT_BITS)];
+  if (*heat < 255) {
+    (*heat)++;
+  }
+  if (++tier->heat_ticks == sizeof(tier->heat)) {
+    /* Age the counters, so only recent accesses count. */
+    for (size_t i = 0; i < sizeof(tier->heat); i++) {
+      tier->heat[i] >>= 1;
+    }
+    tier->heat_ticks = 0;
+  }
+  if (*heat < TIER_PROMOTE) {
+    return NULL;
+  }
+  if (tier->free == NULL) {
+    /* The slots evicted now can be used after the next commit. */
+    if (evict(tier) == 0) {
+      tier->starved = 1;
+    }
+    pthread_cond_signal(&tier->work);
+    return NULL;
+  }
+  *heat = 0;
+  s = tier->free;
+  tier->free = s->next;
+  map(tier, s, block);
+  s->state = SLOT_FILLING;
+  s->refs = 1;
+  tier->stats.promotions++;
+  return s;
+}
+
+static void put(struct buse_tier *tier, struct tier_slot *s) {
+  pthread_mutex_lock(&tier->lock);
+  release(tier, s);
+  pthread_mutex_unlock(&tier->lock);
+}
+
+/* Fill a new slot with its block from the backend, merging in n bytes of
+ * data at pos for a write, or copying n bytes at pos to out for a read, and
+ * drop the reference. Returns the backend's error; *filled tells whether
+ * the slot now holds the block. */
+static int fill(struct buse_tier *tier, struct tier_slot *s, const void *data, void *out,
+    u_int64_t pos, u_int32_t n, int *filled) {
+  u_int64_t start = s->block << TIER_BLOCK_SHIFT;
+  char *block = malloc(BUSE_TIER_BLOCK_SIZE);
+  int ret = 0, saved = 0;
+
+  if (block != NULL) {
+    if (data == NULL || n < BUSE_TIER_BLOCK_SIZE) {
+      ret = origin_read(tier, block, BUSE_TIER_BLOCK_SIZE, start);
+    }
+    if (ret == 0) {
+      if (data) {
+        memcpy(block + (pos - start), data, n);
+      } else {
+        memcpy(out, block + (pos - start), n);
+      }
+      saved = file_write(tier->fd, block, BUSE_TIER_BLOCK_SIZE, slot_offset(tier, s)) == 0;
+    }
+  } else if (out) {
+    ret = ENOMEM;
+  }
+  free(block);
+
+  pthread_mutex_lock(&tier->lock);
+  s->refs--;
+  if (saved) {
+    s->state = SLOT_READY;
+    /* The entry was written free while filling. */
+    meta_touch(tier, s);
+    if (data) {
+      set_dirty(tier, s, 1);
+    }
+  } else {
+    unmap(tier, s, 0);
+    tier->stats.promotions--;
+  }
+  pthread_cond_broadcast(&tier->ready);
+  pthread_mutex_unlock(&tier->lock);
+  *filled = saved;
+  return ret;
+}
+
+/* After data went to the backend: update the copies of the blocks it
+ * touched, which may have been promoted from older data meanwhile. */
+static void update_cached(struct buse_tier *tier, const void *data, u_int32_t len, u_int64_t offset,
+    int failed) {
+  u_int64_t pos, next, end = offset + len;
+  struct tier_slot *s;
+
+  for (pos = offset; pos < end; pos = next) {
+    next = ((pos >> TIER_BLOCK_SHIFT) + 1) << TIER_BLOCK_SHIFT;
+    if (next > end) {
+      next = end;
+    }
+    pthread_mutex_lock(&tier->lock);
+    s = acquire(tier, pos >> TIER_BLOCK_SHIFT, 0);
+    if (!tier->writeback) {
+      if (s) {
+        tier->stats.write_hits++;
+      } else {
+        tier->stats.write_misses++;
+      }
+    }
+    pthread_mutex_unlock(&tier->lock);
+    if (s == NULL) {
+      continue;
+    }
+    if (failed || file_write(tier->fd, (const char *)data + (pos - offset), next - pos,
+          slot_offset(tier, s) + (pos & TIER_BLOCK_MASK)) != 0) {
+      /* Its copy may be stale now, but a dirty one is all there is. */
+      pthread_mutex_lock(&tier->lock);
+      if (!s->dirty) {
+        discard(tier, s);
+      }
+      release(tier, s);
+      pthread_mutex_unlock(&tier->lock);
+    } else {
+      put(tier, s);
+    }
+  }
+}
+
+static int tier_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+  struct buse_tier *tier = userdata;
+  u_int64_t pos, next, run = offset, end = offset + len;
+  struct tier_slot *s;
+  int seq, filling, done, ret = 0;
+
+  pthread_mutex_lock(&tier->lock);
+  tier->requests++;
+  seq = sequential(tier, offset, len);
+  pthread_mutex_unlock(&tier->lock);
+
+  /* Blocks served by the tier split the request, what is between them is
+   * read from the backend in one go. */
+  for (pos = offset; pos < end && ret == 0; pos = next) {
+    next = ((pos >> TIER_BLOCK_SHIFT) + 1) << TIER_BLOCK_SHIFT;
+    if (next > end) {
+      next = end;
+    }
+    pthread_mutex_lock(&tier->lock);
+    s = acquire(tier, pos >> TIER_BLOCK_SHIFT, !seq);
+    filling = s && s->state == SLOT_FILLING;
+    if (s && !filling) {
+      tier->stats.read_hits++;
+    } else {
+      tier->stats.read_misses++;
+      tier->stats.bypassed += seq;
+    }
+    pthread_mutex_unlock(&tier->lock);
+    if (s == NULL) {
+      continue;
+    }
+    if (filling) {
+      done = fill(tier, s, NULL, (char *)buf + (pos - offset), pos, next - pos, &filling) == 0;
+    } else {
+      done = file_read(tier->fd, (char *)buf + (pos - offset), next - pos,
+          slot_offset(tier, s) + (pos & TIER_BLOCK_MASK)) == 0;
+      put(tier, s);
+    }
+    /* If the fast device failed, the block is read with the run. */
+    if (done) {
+      if (run < pos) {
+        ret = origin_read(tier, (char *)buf + (run - offset), pos - run, run);
+      }
+      run = next;
+    }
+  }
+  if (ret == 0 && run < end) {
+    ret = origin_read(tier, (char *)buf + (run - offset), end - run, run);
+  }
+  return ret;
+}
+
+static int tier_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+  struct buse_tier *tier = userdata;
+  u_int64_t pos, next, run = offset, end = offset + len;
+  const char *data;
+  struct tier_slot *s;
+  int seq, filling, done, ret;
+
+  pthread_mutex_lock(&tier->lock);
+  tier->requests++;
+  seq = sequential(tier, offset, len);
+  pthread_mutex_unlock(&tier->lock);
+
+  if (!tier->writeback) {
+    ret = origin_write(tier, buf, len, offset);
+    update_cached(tier, buf, len, offset, ret != 0);
+    return ret;
+  }
+
+  /* Write-back: blocks in the tier, or promoted now, are only written
+   * there, what is between them goes to the backend in one go. */
+  for (pos = offset; pos < end; pos = next) {
+    next = ((pos >> TIER_BLOCK_SHIFT) + 1) << TIER_BLOCK_SHIFT;
+    if (next > end) {
+      next = end;
+    }
+    data = (const char *)buf + (pos - offset);
+    pthread_mutex_lock(&tier->lock);
+    s = acquire(tier, pos >> TIER_BLOCK_SHIFT, !seq);
+    filling = s && s->state == SLOT_FILLING;
+    if (s && !filling) {
+      tier->stats.write_hits++;
+    } else {
+      tier->stats.write_misses++;
+      tier->stats.bypassed += seq;
+    }
+    pthread_mutex_unlock(&tier->lock);
+    if (s == NULL) {
+      continue;
+    }
+    if (filling) {
+      fill(tier, s, data, NULL, pos, next - pos, &done);
+    } else {
+      done = file_write(tier->fd, data, next - pos, slot_offset(tier, s) + (pos & TIER_BLOCK_MASK)) == 0;
+      pthread_mutex_lock(&tier->lock);
+      if (s->drop) {
+        /* Trimmed or gone stale meanwhile: the backend gets the data. */
+        done = 0;
+      } else if (done) {
+        set_dirty(tier, s, 1);
+      } else if (s->dirty) {
+        /* The rest of the block is only on the fast device. */
+        release(tier, s);
+        pthread_mutex_unlock(&tier->lock);
+        return EIO;
+      } else {
+        discard(tier, s);
+      }
+      release(tier, s);
+      pthread_mutex_unlock(&tier->lock);
+    }
+    if (done) {
+      if (run < pos) {
+        ret = origin_write(tier, (const char *)buf + (run - offset), pos - run, run);
+        update_cached(tier, (const char *)buf + (run - offset), pos - run, run, ret != 0);
+        if (ret != 0) {
+          return ret;
+        }
+      }
+      run = next;
+    }
+  }
+  if (run < end) {
+    ret = origin_write(tier, (const char *)buf + (run - offset), end - run, run);
+    update_cached(tier, (const char *)buf + (run - offset), end - run, run, ret != 0);
+    return ret;
+  }
+  return 0;
+}
+
+static int tier_trim(u_int64_t from, u_int32_t len, void *userdata) {
+  struct buse_tier *tier = userdata;
+  u_int64_t first = from >> TIER_BLOCK_SHIFT;
+  u_int64_t last = (from + len + TIER_BLOCK_MASK) >> TIER_BLOCK_SHIFT;
+  struct tier_slot *s;
+  int whole, ret;
+
+  /* A dirty block only partly trimmed has to stay. */
+  pthread_mutex_lock(&tier->lock);
+  for (u_int64_t block = first; block < last && len > 0; block++) {
+    s = acquire(tier, block, 0);
+    if (s) {
+      whole = block << TIER_BLOCK_SHIFT >= from && (block + 1) << TIER_BLOCK_SHIFT <= from + len;
+      if (whole || !s->dirty) {
+        discard(tier, s);
+      }
+      release(tier, s);
+    }
+  }
+  pthread_mutex_unlock(&tier->lock);
+
+  backend_enter(tier);
+  ret = tier->backend.trim(from, len, tier->userdata);
+  backend_leave(tier);
+  return ret;
+}
+
+static void encode(struct buse_tier *tier, u_int64_t index, struct tier_meta *m) {
+  struct tier_slot *s = index < tier->nslots ? &tier->slots[index] : NULL;
+
+  memset(m, 0, sizeof(*m));
+  if (s == NULL || s->block == TIER_FREE || s->state == SLOT_FILLING) {
+    m->block = htole64(TIER_FREE);
+  } else {
+    m->block = htole64(s->block);
+    m->flags = htole32(s->dirty ? TIER_DIRTY : 0);
+  }
+}
+
+/* Bring the metadata on the fast device up to date. The slots are synced
+ * first, so no entry names a slot whose data isn't there yet, and so is the
+ * backend if blocks were written back, as their entries may be dropped now;
+ * limbo slots whose entries were written can be reused afterwards. */
+static int commit(struct buse_tier *tier) {
+  struct tier_meta *pages = NULL;
+  struct tier_slot *limbo, *s, *next;
+  u_int64_t *index = NULL, n = 0;
+  int ret = 0, flush_origin;
+
+  pthread_mutex_lock(&tier->commit_lock);
+  pthread_mutex_lock(&tier->lock);
+  for (u_int64_t p = 0; p < tier->meta_pages; p++) {
+    n += (tier->meta_dirty[p / 64] >> (p % 64)) & 1;
+  }
+  if (n > 0) {
+    pages = malloc(n * TIER_META_PAGE);
+    index = malloc(n * sizeof(*index));
+    if (pages == NULL || index == NULL) {
+      pthread_mutex_unlock(&tier->lock);
+      pthread_mutex_unlock(&tier->commit_lock);
+      free(pages);
+      free(index);
+      return ENOMEM;
+    }
+  }
+  n = 0;
+  for (u_int64_t p = 0; p < tier->meta_pages; p++) {
+    if (!((tier->meta_dirty[p / 64] >> (p % 64)) & 1)) {
+      continue;
+    }
+    tier->meta_dirty[p / 64] &= ~(1ULL << (p % 64));
+    for (u_int64_t i = 0; i < TIER_PAGE_ENTRIES; i++) {
+      encode(tier, p * TIER_PAGE_ENTRIES + i, &pages[n * TIER_PAGE_ENTRIES + i]);
+    }
+    index[n++] = p;
+  }
+  limbo = tier->limbo;
+  tier->limbo = NULL;
+  flush_origin = tier->cleaned;
+  tier->cleaned = 0;
+  pthread_mutex_unlock(&tier->lock);
+
+  if (fdatasync(tier->fd) == -1) {
+    ret = errno;
+  } else if (flush_origin) {
+    ret = origin_flush(tier);
+  }
+  for (u_int64_t i = 0; i < n && ret == 0; i++) {
+    ret = file_write(tier->fd, &pages[i * TIER_PAGE_ENTRIES], TIER_META_PAGE,
+        TIER_HEADER_SIZE + index[i] * TIER_META_PAGE);
+  }
+  if (ret == 0 && n > 0 && fdatasync(tier->fd) == -1) {
+    ret = errno;
+  }
+
+  pthread_mutex_lock(&tier->lock);
+  if (ret != 0) {
+    for (u_int64_t i = 0; i < n; i++) {
+      tier->meta_dirty[index[i] / 64] |= 1ULL << (index[i] % 64);
+    }
+    tier->cleaned |= flush_origin;
+  }
+  for (s = limbo; s != NULL; s = next) {
+    next = s->next;
+    /* Someone may still be reading what it held before. */
+    if (ret == 0 && s->refs == 0) {
+      s->next = tier->free;
+      tier->free = s;
+    } else {
+      s->next = tier->limbo;
+      tier->limbo = s;
+    }
+  }
+  pthread_mutex_unlock(&tier->lock);
+  pthread_mutex_unlock(&tier->commit_lock);
+  free(pages);
+  free(index);
+  return ret;
+}
+
+/* Write a batch of dirty blocks back to the backend. Called and returns
+ * with the lock held. */
+static int clean(struct buse_tier *tier, char *block) {
+  struct tier_slot *batch[TIER_CLEAN_BATCH], *s;
+  int n = 0, ret;
+
+  for (u_int64_t i = 0; i < tier->nslots && i < TIER_SCAN && n < TIER_CLEAN_BATCH; i++) {
+    s = &tier->slots[tier->clean_hand];
+    tier->clean_hand = (tier->clean_hand + 1) % tier->nslots;
+    if (s->block != TIER_FREE && s->dirty && s->state == SLOT_READY && s->refs == 0) {
+      s->state = SLOT_CLEANING;
+      batch[n++] = s;
+    }
+  }
+  pthread_mutex_unlock(&tier->lock);
+  for (int i = 0; i < n; i++) {
+    s = batch[i];
+    ret = file_read(tier->fd, block, BUSE_TIER_BLOCK_SIZE, slot_offset(tier, s));
+    if (ret == 0) {
+      ret = origin_write(tier, block, BUSE_TIER_BLOCK_SIZE, s->block << TIER_BLOCK_SHIFT);
+    }
+    pthread_mutex_lock(&tier->lock);
+    s->state = SLOT_READY;
+    if (ret == 0) {
+      set_dirty(tier, s, 0);
+      tier->cleaned = 1;
+      tier->stats.cleaned++;
+    }
+    pthread_cond_broadcast(&tier->ready);
+    pthread_mutex_unlock(&tier->lock);
+  }
+  pthread_mutex_lock(&tier->lock);
+  return n;
+}
+
+static void *tier_thread(void *arg) {
+  struct buse_tier *tier = arg;
+  char *block = malloc(BUSE_TIER_BLOCK_SIZE);
+  struct timespec deadline;
+  u_int64_t seen = 0;
+
+  pthread_mutex_lock(&tier->lock);
+  while (!tier->stop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += TIER_TICK_NS;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&tier->work, &tier->lock, &deadline);
+    if (block != NULL) {
+      while (tier->stats.dirty > 0 && (tier->stats.dirty * 4 > tier->nslots || tier->starved) &&
+          !tier->stop) {
+        tier->starved = 0;
+        if (clean(tier, block) == 0) {
+          break;
+        }
+      }
+      if (tier->stats.dirty > 0 && tier->requests == seen) {
+        clean(tier, block);
+      }
+    }
+    seen = tier->requests;
+    if (tier->limbo != NULL) {
+      pthread_mutex_unlock(&tier->lock);
+      commit(tier);
+      pthread_mutex_lock(&tier->lock);
+    }
+  }
+  pthread_mutex_unlock(&tier->lock);
+  free(block);
+  return NULL;
+}
+
+/* Write-back mode needs the dirty slots and their entries stable as well. */
+static int tier_flush(void *userdata) {
+  struct buse_tier *tier = userdata;
+  int ret = 0;
+
+  if (tier->writeback) {
+    ret = commit(tier);
+  }
+  if (ret == 0) {
+    ret = origin_flush(tier);
+  }
+  return ret;
+}
+
+static void tier_disc(void *userdata) {
+  struct buse_tier *tier = userdata;
+
+  buse_tier_close(tier);
+  if (tier->backend.disc) {
+    tier->backend.disc(tier->userdata);
+  }
+}
+
+static void tier_thread_init(u_int32_t index, void *userdata) {
+  struct buse_tier *tier = userdata;
+
+  tier->backend.thread_init(index, tier->userdata);
+}
+
+static int write_header(struct buse_tier *tier, int clean) {
+  struct tier_header hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TIER_MAGIC, sizeof(hdr.magic));
+  hdr.version = htole32(TIER_VERSION);
+  hdr.block_shift = htole32(TIER_BLOCK_SHIFT);
+  hdr.nslots = htole64(tier->nslots);
+  hdr.origin_size = htole64(tier->ops.size);
+  hdr.clean = htole32(clean);
+  hdr.writeback = htole32(tier->writeback);
+  return file_write(tier->fd, &hdr, sizeof(hdr), 0);
+}
+
+/* Set up the slots from the metadata on disk, if it is for this backend. */
+static int load(struct buse_tier *tier, const char *path) {
+  struct tier_header hdr;
+  struct tier_meta *page;
+  struct tier_slot *s;
+  u_int64_t block;
+  int ret, clean, last_writeback, dirty;
+
+  ret = file_read(tier->fd, &hdr, sizeof(hdr), 0);
+  if (ret != 0) {
+    return ret;
+  }
+  for (u_int64_t i = tier->nslots; i-- > 0;) {
+    tier->slots[i].block = TIER_FREE;
+  }
+  if (memcmp(hdr.magic, TIER_MAGIC, sizeof(hdr.magic)) != 0 ||
+      le32toh(hdr.version) != TIER_VERSION ||
+      le32toh(hdr.block_shift) != TIER_BLOCK_SHIFT ||
+      le64toh(hdr.nslots) != tier->nslots ||
+      le64toh(hdr.origin_size) != tier->ops.size) {
+    if (memcmp(hdr.magic, TIER_MAGIC, sizeof(hdr.magic)) == 0) {
+      warnx("%s was set up for another device, starting empty", path);
+    }
+    for (u_int64_t i = tier->nslots; i-- > 0;) {
+      tier->slots[i].next = tier->free;
+      tier->free = &tier->slots[i];
+    }
+    memset(tier->meta_dirty, 0xff, (tier->meta_pages + 63) / 64 * sizeof(u_int64_t));
+    return 0;
+  }
+
+  clean = le32toh(hdr.clean);
+  last_writeback = le32toh(hdr.writeback);
+  page = malloc(TIER_META_PAGE);
+  if (page == NULL) {
+    return ENOMEM;
+  }
+  for (u_int64_t p = tier->meta_pages; p-- > 0;) {
+    ret = file_read(tier->fd, page, TIER_META_PAGE, TIER_HEADER_SIZE + p * TIER_META_PAGE);
+    if (ret != 0) {
+      free(page);
+      return ret;
+    }
+    for (u_int64_t i = TIER_PAGE_ENTRIES; i-- > 0;) {
+      if (p * TIER_PAGE_ENTRIES + i >= tier->nslots) {
+        continue;
+      }
+      s = &tier->slots[p * TIER_PAGE_ENTRIES + i];
+      block = le64toh(page[i].block);
+      dirty = le32toh(page[i].flags) & TIER_DIRTY;
+      if (block == TIER_FREE) {
+        s->next = tier->free;
+        tier->free = s;
+        continue;
+      }
+      if (block >= tier->nblocks || lookup(tier, block) != NULL || (!clean && !last_writeback && !dirty)) {
+        /* Not to be trusted, but named on disk. */
+        s->next = tier->limbo;
+        tier->limbo = s;
+        meta_touch(tier, s);
+        continue;
+      }
+      map(tier, s, block);
+      set_dirty(tier, s, dirty || (!clean && last_writeback));
+    }
+  }
+  free(page);
+  return 0;
+}
+
+static int fd_size(int fd, u_int64_t *size) {
+  struct stat st;
+
+  if (fstat(fd, &st) == -1) {
+    return errno;
+  }
+  if (S_ISBLK(st.st_mode)) {
+    return ioctl(fd, BLKGETSIZE64, size) == -1 ? errno : 0;
+  }
+  *size = st.st_size;
+  return 0;
+}
+
+struct buse_tier *buse_tier_create(const struct buse_operations *backend, void *userdata,
+    const char *path, int writeback) {
+  struct buse_tier *tier;
+  pthread_condattr_t attr;
+  u_int64_t fsize, size;
+  int ret;
+
+  /* Only the synchronous interface can be wrapped. */
+  assert(backend->read != NULL && backend->write != NULL && backend->submit == NULL);
+  tier = calloc(1, sizeof(*tier));
+  if (tier == NULL) {
+    return NULL;
+  }
+  tier->backend = *backend;
+  tier->userdata = userdata;
+  tier->serialize = backend->threads <= 1;
+  tier->writeback = writeback;
+  tier->ops = *backend;
+  tier->ops.read = tier_read;
+  tier->ops.write = tier_write;
+  tier->ops.trim = backend->trim ? tier_trim : NULL;
+  tier->ops.flush = tier_flush;
+  tier->ops.disc = tier_disc;
+  tier->ops.thread_init = backend->thread_init ? tier_thread_init : NULL;
+  size = backend->size ? backend->size : (u_int64_t)backend->blksize * backend->size_blocks;
+  tier->ops.size = size;
+  tier->ops.blksize = 0;
+  tier->ops.size_blocks = 0;
+  tier->nblocks = size >> TIER_BLOCK_SHIFT;
+
+  pthread_mutex_init(&tier->backend_lock, NULL);
+  pthread_mutex_init(&tier->lock, NULL);
+  pthread_mutex_init(&tier->commit_lock, NULL);
+  pthread_cond_init(&tier->ready, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&tier->work, &attr);
+  pthread_condattr_destroy(&attr);
+
+  tier->fd = open(path, O_RDWR);
+  if (tier->fd == -1) {
+    ret = errno;
+    goto fail;
+  }
+  ret = fd_size(tier->fd, &fsize);
+  if (ret != 0) {
+    goto fail;
+  }
+  /* As many slots as fit after their metadata. */
+  tier->nslots = fsize / (BUSE_TIER_BLOCK_SIZE + sizeof(struct tier_meta)) + 1;
+  do {
+    tier->nslots--;
+    tier->meta_pages = (tier->nslots + TIER_PAGE_ENTRIES - 1) / TIER_PAGE_ENTRIES;
+    tier->data_offset = (TIER_HEADER_SIZE + tier->meta_pages * TIER_META_PAGE + TIER_BLOCK_MASK) &
+        ~(u_int64_t)TIER_BLOCK_MASK;
+  } while (tier->nslots > 0 && tier->data_offset + (tier->nslots << TIER_BLOCK_SHIFT) > fsize);
+  if (tier->nslots == 0) {
+    ret = ENOSPC;
+    goto fail;
+  }
+
+  for (tier->mask = 16; tier->mask < tier->nslots; tier->mask <<= 1)
+    ;
+  tier->buckets = calloc(tier->mask, sizeof(*tier->buckets));
+  tier->mask -= 1;
+  tier->slots = calloc(tier->nslots, sizeof(*tier->slots));
+  tier->meta_dirty = calloc((tier->meta_pages + 63) / 64, sizeof(u_int64_t));
+  if (tier->buckets == NULL || tier->slots == NULL || tier->meta_dirty == NULL) {
+    ret = ENOMEM;
+    goto fail;
+  }
+
+  /* Mark it in use before anything changes, then clear the entries that
+   * can't be trusted. */
+  ret = load(tier, path);
+  if (ret == 0) {
+    ret = write_header(tier, 0);
+  }
+  if (ret == 0) {
+    ret = commit(tier);
+  }
+  if (ret != 0) {
+    goto fail;
+  }
+  if (pthread_create(&tier->thread, NULL, tier_thread, tier) != 0) {
+    ret = EAGAIN;
+    goto fail;
+  }
+  tier->running = 1;
+  return tier;
+
+fail:
+  if (tier->fd != -1) {
+    close(tier->fd);
+  }
+  free(tier->buckets);
+  free(tier->slots);
+  free(tier->meta_dirty);
+  free(tier);
+  errno = ret;
+  return NULL;
+}
+
+const struct buse_operations *buse_tier_operations(struct buse_tier *tier) {
+  return &tier->ops;
+}
+
+int buse_tier_close(struct buse_tier *tier) {
+  int ret;
+
+  pthread_mutex_lock(&tier->lock);
+  tier->stop = 1;
+  pthread_cond_signal(&tier->work);
+  pthread_mutex_unlock(&tier->lock);
+  if (tier->running) {
+    pthread_join(tier->thread, NULL);
+    tier->running = 0;
+  }
+  ret = commit(tier);
+  if (ret == 0) {
+    ret = write_header(tier, 1);
+  }
+  if (ret == 0 && fdatasync(tier->fd) == -1) {
+    ret = errno;
+  }
+  return ret;
+}
+
+void buse_tier_get_stats(struct buse_tier *tier, struct buse_tier_stats *stats) {
+  pthread_mutex_lock(&tier->lock);
+  *stats = tier->stats;
+  pthread_mutex_unlock(&tier->lock);
+}
+
+void buse_tier_print_stats(struct buse_tier *tier, FILE *out) {
+  struct buse_tier_stats st;
+  u_int64_t reads;
+
+  buse_tier_get_stats(tier, &st);
+  reads = st.read_hits + st.read_misses;
+  fprintf(out, "tier: %lu blocks held, %lu dirty, %lu read hits, %lu read misses (%.1f%% hit rate), "
+          "%lu write hits, %lu write misses, %lu bypassed as sequential, %lu promotions, "
+          "%lu evictions, %lu written back\n",
+          st.cached, st.dirty, st.read_hits, st.read_misses, reads ? 100.0 * st.read_hits / reads : 0.0,
+          st.write_hits, st.write_misses, st.bypassed, st.promotions, st.evictions, st.cleaned);
+}
@@ -0,0 +1,697 @@
+/*
+ * writeback - write-back buffer for BUSE backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Writes are acknowledged once they are copied into memory. The dirty data
+ * is kept as extents in a treap ordered by offset. Extents never overlap: a
+ * new write trims or replaces the parts of older ones it covers, so the
+ * extents overlapping a range are the last one starting before it and the
+ * ones starting inside it.
+ *
+ * A destage thread writes the extents back in offset order, a few MB per
+ * pass, merging adjacent extents into one backend write. It runs when half
+ * the buffer is dirty, when data has been dirty for a while, when a writer
+ * waits for room and while a flush is waiting.
+ *
+ * An extent stays in the tree, and keeps serving reads, until its data has
+ * reached the backend. Any change to an extent gives it a new id, so after
+ * a pass only the extents that weren't changed meanwhile are dropped; the
+ * others are written again later. As only the destage thread writes to the
+ * backend, an older version of some data can't overtake a newer one.
+ */
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "writeback.h"
+
+#define WB_MIN_CAPACITY (1 << 20)
+#define WB_BATCH (4 << 20)            /* bytes written back per pass */
+#define WB_EXPIRE_NS 2000000000LL     /* how long data may stay dirty */
+#define WB_TICK_NS 100000000LL
+
+struct wb_extent {
+  u_int64_t start;
+  u_int32_t len;
+  u_int32_t prio;
+  u_int64_t id;   /* changes whenever the extent does */
+  u_int64_t seq;  /* when its oldest data was written */
+  char *data;
+  struct wb_extent *left, *right;
+};
+
+struct buse_writeback {
+  struct buse_operations ops;
+  struct buse_operations backend;
+  void *userdata;
+  int serialize;                 /* the backend handles one call at a time */
+  pthread_mutex_t backend_lock;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;           /* wakes the destage thread */
+  pthread_cond_t progress;       /* a pass finished */
+  struct wb_extent *root;
+  u_int64_t capacity;
+  u_int64_t dirty;
+  u_int64_t next_id;
+  u_int64_t cursor;              /* where the next pass starts */
+  u_int64_t passes;
+  struct timespec dirty_since;
+  int flushing;                  /* flushes waiting for the destage */
+  int waiting;                   /* writers waiting for room */
+  int busy;                      /* a pass is writing to the backend */
+  int stop;
+  int error;                     /* first failed write back, for the next flush */
+  int running;
+  pthread_t thread;
+  struct buse_writeback_stats stats;
+};
+
+/* The last extent starting at or before offset. */
+static struct wb_extent *tree_floor(struct wb_extent *t, u_int64_t offset) {
+  struct wb_extent *best = NULL;
+
+  while (t) {
+    if (t->start <= offset) {
+      best = t;
+      t = t->right;
+    } else {
+      t = t->left;
+    }
+  }
+  return best;
+}
+
+/* The first extent starting at or after offset. */
+static struct wb_extent *tree_ceil(struct wb_extent *t, u_int64_t offset) {
+  struct wb_extent *best = NULL;
+
+  while (t) {
+    if (t->start >= offset) {
+      best = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return best;
+}
+
+static void tree_insert(struct wb_extent **t, struct wb_extent *e) {
+  struct wb_extent *x = *t, *child;
+
+  if (x == NULL) {
+    e->left = e->right = NULL;
+    *t = e;
+    return;
+  }
+  if (e->start < x->start) {
+    tree_insert(&x->left, e);
+    if (x->left->prio > x->prio) {
+      child = x->left;
+      x->left = child->right;
+      child->right = x;
+      *t = child;
+    }
+  } else {
+    tree_insert(&x->right, e);
+    if (x->right->prio > x->prio) {
+      child = x->right;
+      x->right = child->left;
+      child->left = x;
+      *t = child;
+    }
+  }
+}
+
+/* Join two treaps, all of a lying before b. */
+static struct wb_extent *tree_join(struct wb_extent *a, struct wb_extent *b) {
+  if (a == NULL) {
+    return b;
+  }
+  if (b == NULL) {
+    return a;
+  }
+  if (a->prio > b->prio) {
+    a->right = tree_join(a->right, b);
+    return a;
+  }
+  b->left = tree_join(a, b->left);
+  return b;
+}
+
+static void tree_remove(struct wb_extent **t, struct wb_extent *e) {
+  while (*t != e) {
+    t = e->start < (*t)->start ? &(*t)->left : &(*t)->right;
+  }
+  *t = tree_join(e->left, e->right);
+}
+
+static u_int64_t tree_min_seq(struct wb_extent *t) {
+  u_int64_t min, sub;
+
+  if (t == NULL) {
+    return (u_int64_t)-1;
+  }
+  min = t->seq;
+  if ((sub = tree_min_seq(t->left)) < min) {
+    min = sub;
+  }
+  if ((sub = tree_min_seq(t->right)) < min) {
+    min = sub;
+  }
+  return min;
+}
+
+/* Add e to the tree under a fresh id. */
+static void link_extent(struct buse_writeback *wb, struct wb_extent *e) {
+  e->id = ++wb->next_id;
+  e->prio = (u_int32_t)((e->id * 0x9e3779b97f4a7c15ULL) >> 32);
+  tree_insert(&wb->root, e);
+  wb->stats.extents++;
+}
+
+static void drop_extent(struct buse_writeback *wb, struct wb_extent *e) {
+  tree_remove(&wb->root, e);
+  wb->stats.extents--;
+  wb->dirty -= e->len;
+  free(e->data);
+  free(e);
+}
+
+static struct wb_extent *new_extent(u_int64_t start, u_int32_t len) {
+  struct wb_extent *e = malloc(sizeof(*e));
+
+  if (e == NULL) {
+    return NULL;
+  }
+  e->data = malloc(len);
+  if (e->data == NULL) {
+    free(e);
+    return NULL;
+  }
+  e->start = start;
+  e->len = len;
+  return e;
+}
+
+/* Drop the dirty data in [offset, end), trimming the extents that stick
+ * out of it. Splitting an extent around the range can fail with ENOMEM. */
+static int punch(struct buse_writeback *wb, u_int64_t offset, u_int64_t end) {
+  struct wb_extent *e = tree_floor(wb->root, offset), *tail;
+  u_int64_t e_end;
+  u_int32_t cut;
+
+  if (e && e->start < offset && e->start + e->len > offset) {
+    e_end = e->start + e->len;
+    if (e_end > end) {
+      tail = new_extent(end, e_end - end);
+      if (tail == NULL) {
+        return ENOMEM;
+      }
+      memcpy(tail->data, e->data + (end - e->start), tail->len);
+      tail->seq = e->seq;
+      link_extent(wb, tail);
+      wb->dirty += tail->len;
+    }
+    wb->stats.overwritten += (e_end < end ? e_end : end) - offset;
+    wb->dirty -= e_end - offset;
+    e->len = offset - e->start;
+    e->id = ++wb->next_id;
+  }
+  while ((e = tree_ceil(wb->root, offset)) != NULL && e->start < end) {
+    if (e->start + e->len <= end) {
+      wb->stats.overwritten += e->len;
+      drop_extent(wb, e);
+      continue;
+    }
+    /* Sticks out at the end: keep the part after the range. */
+    cut = end - e->start;
+    tree_remove(&wb->root, e);
+    wb->stats.extents--;
+    memmove(e->data, e->data + cut, e->len - cut);
+    e->start = end;
+    e->len -= cut;
+    link_extent(wb, e);
+    wb->stats.overwritten += cut;
+    wb->dirty -= cut;
+    break;
+  }
+  return 0;
+}
+
+static int64_t elapsed_ns(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)(now.tv_sec - since->tv_sec) * 1000000000LL + (now.tv_nsec - since->tv_nsec);
+}
+
+static int destage_due(struct buse_writeback *wb) {
+  if (wb->dirty == 0) {
+    return 0;
+  }
+  return wb->stop || wb->flushing || wb->waiting || wb->dirty >= wb->capacity / 2 ||
+      elapsed_ns(&wb->dirty_since) >= WB_EXPIRE_NS;
+}
+
+static int backend_write(struct buse_writeback *wb, const void *buf, u_int32_t len, u_int64_t offset) {
+  int ret;
+
+  if (wb->serialize) {
+    pthread_mutex_lock(&wb->backend_lock);
+  }
+  ret = wb->backend.write(buf, len, offset, wb->userdata);
+  if (wb->serialize) {
+    pthread_mutex_unlock(&wb->backend_lock);
+  }
+  return ret;
+}
+
+/* Write back the extents following the cursor, up to WB_BATCH bytes of
+ * them. Called and returns with the lock held, which is released while the
+ * backend is written. Returns ENOMEM if it got nothing done. */
+static int destage(struct buse_writeback *wb) {
+  struct wb_run {
+    u_int64_t offset;
+    u_int32_t len;
+    char *buf;
+  } *runs;
+  struct wb_done {
+    u_int64_t start, id;
+    u_int32_t len;
+  } *done;
+  struct wb_extent *first, *e, *next;
+  u_int64_t n = 0, bytes = 0, nruns = 0, mark;
+  char *data, *p;
+  int ret, error = 0;
+
+  first = tree_ceil(wb->root, wb->cursor);
+  if (first == NULL) {
+    /* A sweep over the whole device is finished, start over. */
+    first = tree_ceil(wb->root, 0);
+    clock_gettime(CLOCK_MONOTONIC, &wb->dirty_since);
+  }
+  for (e = first; e && (n == 0 || bytes + e->len <= WB_BATCH); e = tree_ceil(wb->root, e->start + 1)) {
+    n++;
+    bytes += e->len;
+  }
+  runs = malloc(n * sizeof(*runs));
+  done = malloc(n * sizeof(*done));
+  data = malloc(bytes);
+  if (runs == NULL || done == NULL || data == NULL) {
+    free(runs);
+    free(done);
+    free(data);
+    return ENOMEM;
+  }
+
+  p = data;
+  e = first;
+  for (u_int64_t i = 0; i < n; i++, e = tree_ceil(wb->root, e->start + 1)) {
+    memcpy(p, e->data, e->len);
+    done[i].start = e->start;
+    done[i].id = e->id;
+    done[i].len = e->len;
+    if (nruns > 0 && runs[nruns - 1].offset + runs[nruns - 1].len == e->start) {
+      runs[nruns - 1].len += e->len;
+    } else {
+      runs[nruns].offset = e->start;
+      runs[nruns].len = e->len;
+      runs[nruns].buf = p;
+      nruns++;
+    }
+    p += e->len;
+    wb->cursor = e->start + e->len;
+  }
+  mark = ++wb->next_id;
+  wb->busy = 1;
+  pthread_mutex_unlock(&wb->lock);
+
+  for (u_int64_t i = 0; i < nruns; i++) {
+    ret = backend_write(wb, runs[i].buf, runs[i].len, runs[i].offset);
+    if (ret != 0 && error == 0) {
+      error = ret;
+    }
+  }
+
+  pthread_mutex_lock(&wb->lock);
+  /* What is in the ranges written now is either unchanged, and clean, or
+   * has pieces older than mark that were written and newer ones. A failed
+   * write back is only reported by the next flush, like fsync(); the data
+   * is dropped all the same, as retrying it won't help. */
+  for (u_int64_t i = 0; i < n; i++) {
+    for (e = tree_ceil(wb->root, done[i].start); e && e->start < done[i].start + done[i].len; e = next) {
+      next = tree_ceil(wb->root, e->start + 1);
+      if (e->id == done[i].id) {
+        drop_extent(wb, e);
+      } else if (e->seq < mark) {
+        e->seq = mark;
+      }
+    }
+  }
+  if (error != 0 && wb->error == 0) {
+    wb->error = error;
+  }
+  wb->stats.batches++;
+  wb->stats.writes += nruns;
+  wb->stats.destaged += bytes;
+  wb->busy = 0;
+  wb->passes++;
+  pthread_cond_broadcast(&wb->progress);
+  free(runs);
+  free(done);
+  free(data);
+  return 0;
+}
+
+static void *destage_thread(void *arg) {
+  struct buse_writeback *wb = arg;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&wb->lock);
+  for (;;) {
+    if (destage_due(wb) && destage(wb) == 0) {
+      continue;
+    }
+    if (wb->stop && wb->dirty == 0) {
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += WB_TICK_NS;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&wb->work, &wb->lock, &deadline);
+  }
+  pthread_mutex_unlock(&wb->lock);
+  return NULL;
+}
+
+/* Copy what is dirty of [offset, offset + len) into buf and read the gaps
+ * in between from the backend. An extent is only dropped once it reached
+ * the backend, so a gap can't miss data that is on its way there. */
+static int wb_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+  struct buse_writeback *wb = userdata;
+  struct wb_gap {
+    u_int64_t offset;
+    u_int32_t len;
+  } small[16], *gaps = small, *grown;
+  u_int64_t pos = offset, end = offset + len, from, to;
+  u_int32_t ngaps = 0, max = 16;
+  struct wb_extent *e;
+  int ret = 0;
+
+  pthread_mutex_lock(&wb->lock);
+  e = tree_floor(wb->root, offset);
+  if (e == NULL || e->start + e->len <= offset) {
+    e = tree_ceil(wb->root, offset);
+  }
+  for (; pos < end; e = tree_ceil(wb->root, e->start + 1)) {
+    from = e && e->start < end ? e->start : end;
+    if (from > pos) {
+      if (ngaps == max) {
+        grown = malloc(2 * max * sizeof(*gaps));
+        if (grown == NULL) {
+          ret = ENOMEM;
+          break;
+        }
+        memcpy(grown, gaps, ngaps * sizeof(*gaps));
+        if (gaps != small) {
+          free(gaps);
+        }
+        gaps = grown;
+        max *= 2;
+      }
+      gaps[ngaps].offset = pos;
+      gaps[ngaps].len = from - pos;
+      ngaps++;
+      pos = from;
+    }
+    if (pos >= end) {
+      break;
+    }
+    to = e->start + e->len < end ? e->start + e->len : end;
+    memcpy((char *)buf + (pos - offset), e->data + (pos - e->start), to - pos);
+    pos = to;
+  }
+  pthread_mutex_unlock(&wb->lock);
+
+  for (u_int32_t i = 0; i < ngaps && ret == 0; i++) {
+    if (wb->serialize) {
+      pthread_mutex_lock(&wb->backend_lock);
+    }
+    ret = wb->backend.read((char *)buf + (gaps[i].offset - offset), gaps[i].len, gaps[i].offset,
+        wb->userdata);
+    if (wb->serialize) {
+      pthread_mutex_unlock(&wb->backend_lock);
+    }
+  }
+  if (gaps != small) {
+    free(gaps);
+  }
+  return ret;
+}
+
+static int absorb(struct buse_writeback *wb, const void *buf, u_int32_t len, u_int64_t offset) {
+  struct wb_extent *n, *e;
+
+  n = new_extent(offset, len);
+  if (n == NULL) {
+    return ENOMEM;
+  }
+  memcpy(n->data, buf, len);
+
+  pthread_mutex_lock(&wb->lock);
+  if (wb->dirty + len > wb->capacity) {
+    wb->stats.throttled++;
+    wb->waiting++;
+    pthread_cond_signal(&wb->work);
+    while (wb->dirty + len > wb->capacity) {
+      pthread_cond_wait(&wb->progress, &wb->lock);
+    }
+    wb->waiting--;
+  }
+  wb->stats.absorbed += len;
+
+  e = tree_floor(wb->root, offset);
+  if (e && e->start + e->len >= offset + len) {
+    /* Overwrites dirty data only, update it in place. */
+    memcpy(e->data + (offset - e->start), buf, len);
+    e->id = ++wb->next_id;
+    wb->stats.overwritten += len;
+    pthread_mutex_unlock(&wb->lock);
+    free(n->data);
+    free(n);
+    return 0;
+  }
+  /* Can't fail, the range isn't inside a single extent. */
+  punch(wb, offset, offset + len);
+  if (wb->dirty == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &wb->dirty_since);
+  }
+  n->seq = ++wb->next_id;
+  link_extent(wb, n);
+  wb->dirty += len;
+  if (wb->dirty >= wb->capacity / 2) {
+    pthread_cond_signal(&wb->work);
+  }
+  pthread_mutex_unlock(&wb->lock);
+  return 0;
+}
+
+static int wb_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata) {
+  struct buse_writeback *wb = userdata;
+  u_int32_t n, piece = wb->capacity / 4 < WB_BATCH ? wb->capacity / 4 : WB_BATCH;
+  int ret;
+
+  /* Big writes go in pieces, so each fits in the buffer. */
+  for (; len > 0; len -= n, offset += n, buf = (const char *)buf + n) {
+    n = len < piece ? len : piece;
+    ret = absorb(wb, buf, n, offset);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/* Wait until nothing written before now is dirty anymore, then flush the
+ * backend. Returns the first write back error since the last flush. */
+static int wb_flush(void *userdata) {
+  struct buse_writeback *wb = userdata;
+  u_int64_t mark;
+  int ret;
+
+  pthread_mutex_lock(&wb->lock);
+  mark = ++wb->next_id;
+  wb->flushing++;
+  pthread_cond_signal(&wb->work);
+  while (tree_min_seq(wb->root) < mark) {
+    pthread_cond_wait(&wb->progress, &wb->lock);
+  }
+  wb->flushing--;
+  ret = wb->error;
+  wb->error = 0;
+  pthread_mutex_unlock(&wb->lock);
+
+  if (wb->backend.flush) {
+    if (wb->serialize) {
+      pthread_mutex_lock(&wb->backend_lock);
+    }
+    if (ret == 0) {
+      ret = wb->backend.flush(wb->userdata);
+    } else {
+      wb->backend.flush(wb->userdata);
+    }
+    if (wb->serialize) {
+      pthread_mutex_unlock(&wb->backend_lock);
+    }
+  }
+  return ret;
+}
+
+static int wb_trim(u_int64_t from, u_int32_t len, void *userdata) {
+  struct buse_writeback *wb = userdata;
+  u_int64_t passes;
+  int ret;
+
+  pthread_mutex_lock(&wb->lock);
+  ret = punch(wb, from, from + len);
+  /* A pass in progress may still write trimmed data, let it finish so the
+   * trim comes after it. */
+  if (ret == 0 && wb->busy) {
+    passes = wb->passes;
+    while (wb->passes == passes) {
+      pthread_cond_wait(&wb->progress, &wb->lock);
+    }
+  }
+  pthread_mutex_unlock(&wb->lock);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (wb->serialize) {
+    pthread_mutex_lock(&wb->backend_lock);
+  }
+  ret = wb->backend.trim(from, len, wb->userdata);
+  if (wb->serialize) {
+    pthread_mutex_unlock(&wb->backend_lock);
+  }
+  return ret;
+}
+
+static void wb_disc(void *userdata) {
+  struct buse_writeback *wb = userdata;
+
+  buse_writeback_close(wb);
+  if (wb->backend.disc) {
+    wb->backend.disc(wb->userdata);
+  }
+}
+
+static void wb_thread_init(u_int32_t index, void *userdata) {
+  struct buse_writeback *wb = userdata;
+
+  wb->backend.thread_init(index, wb->userdata);
+}
+
+struct buse_writeback *buse_writeback_create(const struct buse_operations *backend,
+    void *userdata, u_int64_t capacity) {
+  struct buse_writeback *wb;
+  pthread_condattr_t attr;
+
+  /* Only the synchronous interface can be wrapped. */
+  assert(backend->read != NULL && backend->write != NULL && backend->submit == NULL);
+  wb = calloc(1, sizeof(*wb));
+  if (wb == NULL) {
+    return NULL;
+  }
+  wb->backend = *backend;
+  wb->userdata = userdata;
+  wb->serialize = backend->threads <= 1;
+  wb->capacity = capacity > WB_MIN_CAPACITY ? capacity : WB_MIN_CAPACITY;
+  wb->ops = *backend;
+  wb->ops.read = wb_read;
+  wb->ops.write = wb_write;
+  wb->ops.trim = backend->trim ? wb_trim : NULL;
+  /* Always advertise a flush, it is how the kernel makes data stable. */
+  wb->ops.flush = wb_flush;
+  wb->ops.disc = wb_disc;
+  wb->ops.thread_init = backend->thread_init ? wb_thread_init : NULL;
+
+  pthread_mutex_init(&wb->backend_lock, NULL);
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_cond_init(&wb->progress, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wb->work, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&wb->thread, NULL, destage_thread, wb) != 0) {
+    free(wb);
+    return NULL;
+  }
+  wb->running = 1;
+  return wb;
+}
+
+const struct buse_operations *buse_writeback_operations(struct buse_writeback *wb) {
+  return &wb->ops;
+}
+
+int buse_writeback_close(struct buse_writeback *wb) {
+  int ret;
+
+  pthread_mutex_lock(&wb->lock);
+  wb->stop = 1;
+  pthread_cond_signal(&wb->work);
+  pthread_mutex_unlock(&wb->lock);
+  if (wb->running) {
+    pthread_join(wb->thread, NULL);
+    wb->running = 0;
+  }
+  pthread_mutex_lock(&wb->lock);
+  ret = wb->error;
+  wb->error = 0;
+  pthread_mutex_unlock(&wb->lock);
+  return ret;
+}
+
+void buse_writeback_get_stats(struct buse_writeback *wb, struct buse_writeback_stats *stats) {
+  pthread_mutex_lock(&wb->lock);
+  *stats = wb->stats;
+  stats->dirty = wb->dirty;
+  pthread_mutex_unlock(&wb->lock);
+}
+
+void buse_writeback_print_stats(struct buse_writeback *wb, FILE *out) {
+  struct buse_writeback_stats st;
+
+  buse_writeback_get_stats(wb, &st);
+  fprintf(out, "writeback: %lu bytes written, %lu overwritten while dirty, %lu written back "
+          "in %lu passes and %lu writes, %lu writes throttled, %lu bytes dirty in %lu extents\n",
+          st.absorbed, st.overwritten, st.destaged, st.batches, st.writes, st.throttled,
+          st.dirty, st.extents);
+}